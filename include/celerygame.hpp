@@ -16,8 +16,15 @@
 #pragma once
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_vulkan.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <bitset>
 #include <cassert>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <coroutine>
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
@@ -34,12 +41,19 @@
 #include <lua.hpp>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <set>
+#include <span>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <vulkan/vulkan.h>
 
@@ -15,6 +15,8 @@
 // limitations under the License.
 #pragma once
 #include "celerygame.hpp"
+#include "celerygame_console_format.hpp"
+#include "celerygame_profiler.hpp"
 namespace celerygame {
 namespace console {
 /// RFC 5424 log levels
@@ -29,122 +31,336 @@ enum class priority : U8 {
   debug = 0x80          ///< Debug-level messages
 };
 
-/// Log within a namespace, a block of code
-void log_namespace(std::string &&, std::function<void(std::string &)> &&);
+/// Priority bits for `p` and everything more severe
+constexpr U8 up_to(priority p /**< [in] the least severe priority */) {
+  return static_cast<U8>((static_cast<U8>(p) << 1) - 1);
+}
+
+/// Named subsystems a line can be logged on, listeners filter per channel
+enum class channel : U8 {
+  general, ///< Anything without a subsystem of its own
+  vulkan,  ///< Vulkan and windowing
+  lua,     ///< The Lua runtime and scripts
+  runloop, ///< The run loop and its tasks
+  jit      ///< LuaJIT's trace compiler
+};
+
+/// How many channels there are
+constexpr auto channel_count = std::size_t{5};
+
+// Release builds keep debug lines too, so a flight recorder has the detail
+// leading up to a crash while other listeners filter them out at runtime
+#ifndef CELERYGAME_LOG_PRIORITY
+#define CELERYGAME_LOG_PRIORITY debug
+#endif
+/// The least severe priority compiled in, see `CELERYGAME_LOG_PRIORITY`
+constexpr auto compiled_priority = priority::CELERYGAME_LOG_PRIORITY;
+
+/// What an asynchronous listener does when its ring buffer is full
+enum class overflow_policy : U8 {
+  drop,  ///< Silently discard the record
+  block, ///< Wait for the writer thread to free enough slots
+  count  ///< Discard the record, then report how many were lost
+};
+
+/// A timestamp and severity tag, formatted once per line for all listeners
+struct prelude {
+  /// Length of "[HH:MM:SS.mmm] [ LVL ] "
+  static constexpr auto length = std::size_t{23};
+
+  char text[length + 1]; ///< Not heap allocated, lives on the caller's stack
+
+  prelude(priority);
+
+  /// View the formatted prelude
+  std::string_view view() const { return std::string_view{text, length}; }
+};
+
+/// A fixed-capacity line, formatted into without touching the heap
+class line {
+public:
+  /// Bytes a line can hold, longer lines are cut short
+  static constexpr auto capacity = std::size_t{2048};
+
+private:
+  char _text[capacity];
+  std::size_t _length = 0;
+
+public:
+  /// User-provided, so `line{}` doesn't zero the whole buffer first
+  line() {}
+
+  /// Append characters, marking the line as cut short when it's full
+  void append(std::string_view str /**< [in] the characters to append */) {
+    auto room = capacity - _length;
+    if (str.size() < room) {
+      std::memcpy(_text + _length, str.data(), str.size());
+      _length += str.size();
+    } else if (room > 0) {
+      std::memcpy(_text + _length, str.data(), room - 1);
+      _text[capacity - 1] = '\n';
+      _length = capacity;
+    }
+  }
+  /// Append a single character
+  void append(char c /**< [in] the character to append */) {
+    append(std::string_view{&c, 1});
+  }
+  /// Append the decimal representation of a number
+  template <class T> void append_number(T number /**< [in] the number */) {
+    // big enough for any integer or the shortest round-tripping double
+    char buf[32];
+    auto result = std::to_chars(buf, buf + sizeof(buf), number);
+    append(std::string_view{buf, static_cast<std::size_t>(result.ptr - buf)});
+  }
+
+  /// View the formatted line
+  std::string_view view() const { return std::string_view{_text, _length}; }
+};
+
+/// Stringify an argument
+inline void stringify(line &current, std::string_view head) {
+  current.append(head);
+}
+/// Stringify an argument
+inline void stringify(line &current, const char *head) {
+  current.append(head == nullptr ? "(null)" : head);
+}
+/// Stringify an argument
+inline void stringify(line &current, char head) { current.append(head); }
+/// Stringify an argument
+inline void stringify(line &current, bool head) {
+  current.append(head ? "true" : "false");
+}
+/// Stringify an argument
+template <class T>
+std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool> &&
+                 !std::is_same_v<T, char>>
+stringify(line &current, T head) {
+  current.append_number(head);
+}
+/// Stringify an argument
+template <glm::length_t L, class T, glm::qualifier Q>
+void stringify(line &current, const glm::vec<L, T, Q> &head) {
+  current.append('(');
+  for (auto i = glm::length_t{0}; i < L; i++) {
+    if (i > 0) {
+      current.append(", ");
+    }
+    stringify(current, head[i]);
+  }
+  current.append(')');
+}
+/// Stringify an argument, column by column
+template <glm::length_t C, glm::length_t R, class T, glm::qualifier Q>
+void stringify(line &current, const glm::mat<C, R, T, Q> &head) {
+  current.append('[');
+  for (auto i = glm::length_t{0}; i < C; i++) {
+    if (i > 0) {
+      current.append(", ");
+    }
+    stringify(current, head[i]);
+  }
+  current.append(']');
+}
+
+/// Intern a string with static storage, returns its binary log ID. Every
+/// call adds a new ID, so call it once per string, see `_literal`.
+U32 intern(const char *, std::size_t);
+
+/// How many literals have been interned so far
+U32 interned_count();
+
+/// Look up an interned literal by its binary log ID
+std::string_view interned(U32);
+
+/// A string literal interned for binary logs, stored by ID in records
+struct literal {
+  std::string_view text; ///< The literal's characters
+  U32 id;                ///< The literal's binary log ID
+};
+
+/// A string literal as a template argument
+template <std::size_t N> struct fixed_string {
+  char data[N];
+  constexpr fixed_string(const char (&str)[N]) {
+    for (auto i = std::size_t{0}; i < N; i++) {
+      data[i] = str[i];
+    }
+  }
+};
+
+inline namespace literals {
+/// Intern a string literal the first time its line is logged, every later
+/// use is a load of the same constant, e.g. `log(p, "frame "_literal, n)`
+template <fixed_string S> const literal &operator""_literal() {
+  static const auto interned_literal = literal{
+      std::string_view{S.data, sizeof(S.data) - 1},
+      intern(S.data, sizeof(S.data) - 1)};
+  return interned_literal;
+}
+} // namespace literals
+
+/// Stringify an argument
+inline void stringify(line &current, const literal &head) {
+  current.append(head.text);
+}
+
+/// A fixed-capacity binary log record, see celerygame_console_format.hpp
+class record {
+public:
+  /// Payload bytes a record can hold, arguments past it are dropped
+  static constexpr auto capacity = std::size_t{2048};
+
+  U64 timestamp;  ///< Microseconds since the epoch
+  priority level; ///< The severity of the record
+
+private:
+  U8 _payload[capacity];
+  std::size_t _length = 0;
+  bool _full = false;
+
+public:
+  /// User-provided, so `record{}` doesn't zero the whole payload first
+  record() {}
+
+  /// Append raw bytes, dropping them and anything after if they don't fit
+  void append(const void *bytes /**< [in] the bytes to append */,
+              std::size_t size /**< [in] how many bytes to append */) {
+    if (_full || size > capacity - _length) {
+      _full = true;
+      return;
+    }
+    std::memcpy(_payload + _length, bytes, size);
+    _length += size;
+  }
+  /// Append a value's bytes as they are in memory
+  template <class T> void append_raw(const T &value /**< [in] the value */) {
+    append(&value, sizeof(T));
+  }
+
+  /// The encoded payload
+  const U8 *data() const { return _payload; }
+  /// Length of the encoded payload
+  std::size_t size() const { return _length; }
+};
+
+/// Is this a glm vector?
+template <class T> struct is_vec : std::false_type {};
+template <glm::length_t L, class T, glm::qualifier Q>
+struct is_vec<glm::vec<L, T, Q>> : std::true_type {};
+/// Is this a glm matrix?
+template <class T> struct is_mat : std::false_type {};
+template <glm::length_t C, glm::length_t R, class T, glm::qualifier Q>
+struct is_mat<glm::mat<C, R, T, Q>> : std::true_type {};
+
+/// Tag for an arithmetic type in a binary log record
+template <class T> constexpr format::tag arithmetic_tag() {
+  if constexpr (std::is_same_v<T, bool>) {
+    return format::tag::boolean;
+  } else if constexpr (std::is_same_v<T, char>) {
+    return format::tag::character;
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return sizeof(T) == 4 ? format::tag::f32 : format::tag::f64;
+  } else if constexpr (std::is_signed_v<T>) {
+    constexpr format::tag tags[] = {format::tag::s8, format::tag::s16,
+                                    format::tag::s32, format::tag::s64};
+    return tags[sizeof(T) == 1 ? 0 : sizeof(T) == 2 ? 1 : sizeof(T) == 4 ? 2
+                                                                         : 3];
+  } else {
+    constexpr format::tag tags[] = {format::tag::u8, format::tag::u16,
+                                    format::tag::u32, format::tag::u64};
+    return tags[sizeof(T) == 1 ? 0 : sizeof(T) == 2 ? 1 : sizeof(T) == 4 ? 2
+                                                                         : 3];
+  }
+}
+
+/// Encode an argument into a binary log record without formatting it
+///
+/// Literals made with `_literal` are stored by ID, any other string has its
+/// bytes copied, a const array could be a buffer on the stack.
+template <class T> void encode(record &current, T &&head) {
+  using type = std::remove_cv_t<std::remove_reference_t<T>>;
+  if constexpr (std::is_same_v<type, literal>) {
+    current.append_raw(format::tag::literal);
+    current.append_raw(head.id);
+  } else if constexpr (std::is_array_v<type>) {
+    encode(current, std::string_view{head});
+  } else if constexpr (std::is_same_v<type, const char *> ||
+                       std::is_same_v<type, char *>) {
+    encode(current, std::string_view{head == nullptr ? "(null)" : head});
+  } else if constexpr (std::is_convertible_v<const type &, std::string_view>) {
+    auto str = std::string_view{head};
+    auto length = static_cast<U16>(std::min<std::size_t>(
+        str.size(), std::numeric_limits<U16>::max()));
+    current.append_raw(format::tag::string);
+    current.append_raw(length);
+    current.append(str.data(), length);
+  } else if constexpr (std::is_arithmetic_v<type>) {
+    current.append_raw(arithmetic_tag<type>());
+    current.append_raw(head);
+  } else if constexpr (is_vec<type>::value) {
+    current.append_raw(format::tag::vec);
+    current.append_raw(static_cast<U8>(type::length()));
+    for (auto i = glm::length_t{0}; i < type::length(); i++) {
+      encode(current, head[i]);
+    }
+  } else if constexpr (is_mat<type>::value) {
+    current.append_raw(format::tag::mat);
+    current.append_raw(static_cast<U8>(type::length()));
+    for (auto i = glm::length_t{0}; i < type::length(); i++) {
+      encode(current, head[i]);
+    }
+  } else {
+    static_assert(std::is_void_v<T>, "Can't encode this type into a record.");
+  }
+}
 
 /// Abstract base class for a console listener
 class listener {
-protected:
-  /// Pre-flight routines for console lines, usually prefixes to prepend
-  virtual void
-  prelude(std::string &str, /**< [in,out] the string to append to */
-          priority p /**< [in] the severity of the line to output */) = 0;
+  /// Priority bits this listener takes, per channel
+  std::array<U8, channel_count> _masks;
+
+public:
+  listener() { _masks.fill(up_to(priority::debug)); }
+  virtual ~listener() = default;
+
+  /// Only take lines whose priority bit is in `mask`, on every channel
+  void set_priorities(U8 mask /**< [in] priority bits, see `up_to` */) {
+    _masks.fill(mask);
+  }
+  /// Only take lines whose priority bit is in `mask`, on one channel
+  void set_priorities(channel c /**< [in] the channel to filter */,
+                      U8 mask /**< [in] priority bits, see `up_to` */) {
+    _masks[static_cast<U8>(c)] = mask;
+  }
+  /// Will this listener take a line?
+  bool accepts(priority p /**< [in] the severity of the line */,
+               channel c /**< [in] the channel of the line */) const {
+    return (_masks[static_cast<U8>(c)] & static_cast<U8>(p)) != 0;
+  }
+
+  /// Does this listener take binary records instead of formatted lines?
+  virtual bool binary() const { return false; }
 
   /// Finalization routines for console lines, usually logging to I/O
   virtual void finalize(
-      std::string &str /**< [in] the post-flighted string to finalize */) = 0;
-
-  /// End call for stringification
-  void stringify(std::string &current /**< [in] the current string*/) {}
-
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, std::string head, Ts... more) {
-    current += head;
-    stringify(current, more...);
-  }
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, const char *head, Ts... more) {
-    current += head;
-    stringify(current, more...);
-  }
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, bool head, Ts... more) {
-    current += (head ? "true" : "false");
-    stringify(current, more...);
-  }
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, U8 head, Ts... more) {
-    current += std::to_string(head);
-    stringify(current, more...);
-  }
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, U16 head, Ts... more) {
-    current += std::to_string(head);
-    stringify(current, more...);
-  }
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, U32 head, Ts... more) {
-    current += std::to_string(head);
-    stringify(current, more...);
-  }
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, U64 head, Ts... more) {
-    current += std::to_string(head);
-    stringify(current, more...);
-  }
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, S8 head, Ts... more) {
-    current += std::to_string(head);
-    stringify(current, more...);
-  }
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, S16 head, Ts... more) {
-    current += std::to_string(head);
-    stringify(current, more...);
-  }
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, S32 head, Ts... more) {
-    current += std::to_string(head);
-    stringify(current, more...);
-  }
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, S64 head, Ts... more) {
-    current += std::to_string(head);
-    stringify(current, more...);
-  }
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, F32 head, Ts... more) {
-    current += std::to_string(head);
-    stringify(current, more...);
-  }
-  /// Stringify an argument
-  template <class... Ts>
-  void stringify(std::string &current, F64 head, Ts... more) {
-    current += std::to_string(head);
-    stringify(current, more...);
-  }
+      priority p,          /**< [in] the severity of the line */
+      std::string_view str /**< [in] the post-flighted line to finalize */) {}
 
-public:
-  /// Log an entry for this terminal listener
-  template <class... Ts>
-  void
-  log(priority p, /**< [in] The severity of the line to log */
-      Ts... more /**< [in] A parameter pack containing the line's parts */) {
-    auto str = std::string{""};
+  /// Finalization routines for binary records, when `binary()` is true
+  virtual void finalize_record(
+      const record &current /**< [in] the encoded record to finalize */) {}
 
-    prelude(str, p);
-    stringify(str, more...);
-    finalize(str);
-  }
+  /// Push every line logged so far out to I/O, called on fatal errors too
+  virtual void flush() {}
 };
 
 /// A listener that logs to stderr
 class terminal_listener : public listener {
 public:
-  void prelude(std::string &, priority);
-  void finalize(std::string &);
+  void finalize(priority, std::string_view) override;
+  void flush() override;
 };
 
 /// A listener that logs to a file
@@ -155,8 +371,137 @@ public:
   file_listener(std::filesystem::path &&);
   ~file_listener();
 
-  void prelude(std::string &, priority);
-  void finalize(std::string &);
+  void finalize(priority, std::string_view) override;
+  void flush() override;
+};
+
+/// A listener that logs to preallocated, memory-mapped, rotating files
+///
+/// Each segment is preallocated to a fixed size and written through a
+/// shared mapping, so logging a line costs a `memcpy` and no syscall. When
+/// a segment fills, it's trimmed and renamed to `<stem>.1<ext>`, older
+/// segments move up by one and the oldest past the limit is deleted. If the
+/// next segment can't be opened, that's reported once on stderr and lines
+/// are dropped from then on.
+class rotating_file_listener : public listener {
+  std::filesystem::path _path;
+  std::size_t _segment_size;
+  U32 _segments_kept;
+  int _descriptor = -1;
+  char *_map = nullptr;
+  std::size_t _used = 0;
+  std::mutex _mutex;
+
+  void open_segment();
+  void close_segment();
+  std::filesystem::path segment_path(U32) const;
+
+public:
+  rotating_file_listener(std::filesystem::path &&,
+                         std::size_t = std::size_t{16} << 20, U32 = 4);
+  ~rotating_file_listener();
+
+  void finalize(priority, std::string_view) override;
+  void flush() override;
+};
+
+/// A listener that keeps the most recent lines in memory, without any I/O
+///
+/// The lines are only written out when one at `error` or worse arrives, on
+/// `flush` (the fatal error path) or on a fatal signal. Each dump appends
+/// the lines since the previous dump to the dump file.
+class flight_recorder_listener : public listener {
+public:
+  /// Bytes kept per line, longer lines are cut short
+  static constexpr auto slot_size = std::size_t{240};
+
+private:
+  /// A recorded line, `sequence` is its line number plus one, 0 if unused
+  struct slot {
+    std::atomic<U64> sequence;
+    U16 length;
+    char data[slot_size];
+  };
+
+  int _descriptor;
+  U64 _mask;
+  std::unique_ptr<slot[]> _slots;
+  std::atomic<U64> _next{0};
+  std::atomic<U64> _dumped{0};
+  std::atomic_flag _dumping = ATOMIC_FLAG_INIT;
+
+public:
+  flight_recorder_listener(std::filesystem::path &&, U32 = 65536);
+  ~flight_recorder_listener();
+
+  void finalize(priority, std::string_view) override;
+  void flush() override;
+
+  /// Append every line recorded since the last dump to the dump file
+  ///
+  /// Only calls `write`, so it's safe to use from a signal handler.
+  void dump();
+};
+
+/// A listener that logs compact binary records to a file
+///
+/// Nothing is formatted on the hot path, `celerygame_logdecode` turns these
+/// files back into text offline.
+class binary_file_listener : public listener {
+  FILE *_file;
+  U32 _defined = 0;
+  std::mutex _mutex;
+
+public:
+  binary_file_listener(std::filesystem::path &&);
+  ~binary_file_listener();
+
+  bool binary() const override { return true; }
+  void finalize_record(const record &) override;
+  void flush() override;
+};
+
+/// A listener that logs to a file from a background writer thread
+///
+/// Producers copy their finished line into a bounded lock-free MPSC ring
+/// buffer. The writer thread drains it in batches, one `fwrite` per batch.
+class async_file_listener : public listener {
+public:
+  /// Bytes per ring buffer slot, longer lines span consecutive slots
+  static constexpr auto slot_size = std::size_t{240};
+
+private:
+  /// A ring buffer slot, `sequence` tells who owns it (Vyukov-style)
+  struct slot {
+    std::atomic<U64> sequence; ///< Ready to write at n, to read at n + 1
+    U16 length;                ///< Bytes used in `data`
+    char data[slot_size];      ///< Part of a line
+  };
+
+  FILE *_file;
+  overflow_policy _policy;
+  U64 _mask;
+  std::unique_ptr<slot[]> _slots;
+  std::unique_ptr<char[]> _batch;
+  alignas(64) std::atomic<U64> _enqueue_position{0};
+  alignas(64) std::atomic<U64> _dequeue_position{0};
+  std::atomic<U64> _written{0};
+  std::atomic<U64> _lost{0};
+  std::atomic<bool> _running{true};
+  std::atomic<U32> _doorbell{0}; ///< Bumped to wake the writer up
+  std::thread _writer;
+
+  bool claim(U64 &, U64);
+  void ring();
+  bool drain();
+
+public:
+  async_file_listener(std::filesystem::path &&,
+                      overflow_policy = overflow_policy::count, U32 = 4096);
+  ~async_file_listener();
+
+  void finalize(priority, std::string_view) override;
+  void flush() override;
 };
 
 /// A data structure for storing all the console listeners currently used
@@ -171,26 +516,108 @@ void deinit();
 /// Get a listing of all active console listeners
 listeners_t *const listeners();
 
-/// Set the maximum priority to log
+/// Flush all active console listeners, use before bailing out on errors
+void flush();
+
+/// Set the least severe priority every listener added so far takes, on every
+/// channel. Set them apart afterwards with `listener::set_priorities`.
 void set_priority(priority);
 
-/// Get the current priority
+/// Get the priority last set with `set_priority`
 priority get_priority();
 
-/// Log to all active console listeners
+/// Will any listener take a line? Nothing past `compiled_priority` is taken.
+bool wants(channel, priority);
+
+/// Log to all active console listeners on a channel
 template <class... Ts>
-void log(priority p /**< [in] The severity of the line to log */,
-         Ts... more /**< [in] A parameter pack containing the line's parts */) {
-  if (static_cast<U8>(get_priority()) < static_cast<U8>(p)) {
+void log(channel c /**< [in] The channel of the line to log */,
+         priority p /**< [in] The severity of the line to log */,
+         Ts &&...more /**< [in] A parameter pack of the line's parts */) {
+  // Each listener filters at runtime, see `listener::accepts`
+  if (static_cast<U8>(compiled_priority) < static_cast<U8>(p)) {
     return;
   }
   auto listeners_listing = listeners();
   if (listeners_listing == nullptr) {
     throw std::runtime_error{"Listeners should exist."};
   }
+  auto wants_line = false;
+  auto wants_record = false;
+  for (auto &&listener : *listeners_listing) {
+    if (listener->accepts(p, c)) {
+      (listener->binary() ? wants_record : wants_line) = true;
+    }
+  }
+  // Nobody will take it, don't bother formatting it
+  if (!wants_line && !wants_record) {
+    return;
+  }
+
+  auto current_line = line{};
+  if (wants_line) {
+    current_line.append(prelude{p}.view());
+    (stringify(current_line, more), ...);
+  }
+  auto current_record = record{};
+  if (wants_record) {
+    current_record.timestamp =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    current_record.level = p;
+    (encode(current_record, more), ...);
+  }
   for (auto &&listener : *listeners_listing) {
-    listener->log(p, more...);
+    if (!listener->accepts(p, c)) {
+      continue;
+    }
+    if (listener->binary()) {
+      listener->finalize_record(current_record);
+    } else {
+      listener->finalize(p, current_line.view());
+    }
+  }
+}
+
+/// Log to all active console listeners
+template <class... Ts>
+void log(priority p /**< [in] The severity of the line to log */,
+         Ts &&...more /**< [in] A parameter pack of the line's parts */) {
+  log(channel::general, p, std::forward<Ts>(more)...);
+}
+
+/// Log to all active console listeners on a channel, compiled out past
+/// `compiled_priority`
+template <priority P, class... Ts>
+void log(channel c /**< [in] The channel of the line to log */,
+         Ts &&...more /**< [in] A parameter pack of the line's parts */) {
+  if constexpr (static_cast<U8>(P) <= static_cast<U8>(compiled_priority)) {
+    log(c, P, std::forward<Ts>(more)...);
+  }
+}
+
+/// Log to all active console listeners, compiled out past `compiled_priority`
+template <priority P, class... Ts>
+void log(Ts &&...more /**< [in] A parameter pack of the line's parts */) {
+  if constexpr (static_cast<U8>(P) <= static_cast<U8>(compiled_priority)) {
+    log(channel::general, P, std::forward<Ts>(more)...);
+  }
+}
+
+/// Log within a namespace, a block of code, and record it as a profiler zone
+template <class F>
+void log_namespace(
+    const char *name /**< [in] the namespace's name, a string literal */,
+    F &&block /**< [in] the block to run, it's passed the name */) {
+  log<priority::debug>("entering '"_literal, name, "'\n"_literal);
+  {
+    auto scope = profiler::zone{name};
+    block(name);
   }
+  log<priority::debug>("exiting '"_literal, name, "'\n"_literal);
 }
 } // namespace console
+// The engine logs its constant strings as interned literals
+using namespace console::literals;
 } // namespace celerygame
@@ -0,0 +1,81 @@
+// Celerygame binary console log format
+//
+// Copyright 2021 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+// This header is shared with the offline decoder, so it only pulls in the
+// standard library.
+#include <cstddef>
+#include <cstdint>
+
+// A binary console log starts with `magic`, then holds a stream of entries.
+// Multi-byte values are stored in host byte order.
+//
+//   literal: [entry::literal] [u32 id] [u16 length] [bytes]
+//   record:  [entry::record] [u64 microseconds since the epoch]
+//            [u8 priority] [u16 payload length] [payload]
+//
+// A record's payload is a sequence of tagged arguments. String literals
+// marked with `_literal` are interned the first time they're logged and
+// referenced by ID afterwards, a literal entry always precedes the first
+// record using it.
+
+namespace celerygame {
+namespace console {
+namespace format {
+/// First bytes of a binary console log, the last byte is the version
+constexpr char magic[8] = {'C', 'G', 'L', 'O', 'G', '\r', '\n', 0x01};
+
+/// Kinds of entries in a binary console log
+enum class entry : std::uint8_t {
+  literal = 0x00, ///< Defines an interned string literal
+  record = 0x01   ///< A logged line
+};
+
+/// Argument tags in a record's payload
+enum class tag : std::uint8_t {
+  literal = 0x00,   ///< [u32 id]
+  string = 0x01,    ///< [u16 length] [bytes]
+  boolean = 0x02,   ///< [u8]
+  character = 0x03, ///< [char]
+  u8 = 0x04,
+  u16 = 0x05,
+  u32 = 0x06,
+  u64 = 0x07,
+  s8 = 0x08,
+  s16 = 0x09,
+  s32 = 0x0A,
+  s64 = 0x0B,
+  f32 = 0x0C,
+  f64 = 0x0D,
+  vec = 0x0E, ///< [u8 length] [tagged elements]
+  mat = 0x0F  ///< [u8 columns] [tagged column vectors]
+};
+
+/// Severity tags, indexed by the bit position of the priority
+constexpr char priority_tags[8][9] = {"[ EMG ] ", "[ ALT ] ", "[ CRT ] ",
+                                      "[ ERR ] ", "[ WRN ] ", "[ NOT ] ",
+                                      "[ INF ] ", "[ DBG ] "};
+
+/// Index into `priority_tags` for a priority's value
+constexpr std::size_t priority_index(std::uint8_t p /**< [in] priority */) {
+  auto index = std::size_t{0};
+  while ((p >> index) > 1) {
+    index++;
+  }
+  return index;
+}
+} // namespace format
+} // namespace console
+} // namespace celerygame
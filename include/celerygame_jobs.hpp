@@ -0,0 +1,112 @@
+// Celerygame include for the work-stealing job system
+//
+// Copyright 2021 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "celerygame.hpp"
+namespace celerygame {
+namespace jobs {
+/// A unit of work, the caller owns it until it has run
+struct job {
+  void (*function)(void *); ///< What to run
+  void *context;            ///< Passed to `function`
+};
+
+/// Jobs each thread's deque holds before `push` runs them inline
+constexpr auto deque_capacity = std::size_t{4096};
+
+/// A Chase-Lev work-stealing deque. The owning thread pushes and takes from
+/// the bottom, any other thread steals from the top.
+template <std::size_t N> class deque {
+  static_assert((N & (N - 1)) == 0, "Deque capacity must be a power of two");
+  alignas(64) std::atomic<S64> _top;
+  alignas(64) std::atomic<S64> _bottom;
+  alignas(64) std::array<std::atomic<job *>, N> _jobs;
+
+public:
+  deque() : _top{0}, _bottom{0} {}
+  deque(const deque &) = delete;
+  deque &operator=(const deque &) = delete;
+
+  /// Push a job on the bottom, owner only. Returns false if full.
+  bool push(job *j /**< [in] the job */) {
+    auto b = _bottom.load(std::memory_order_relaxed);
+    auto t = _top.load(std::memory_order_acquire);
+    if (b - t >= static_cast<S64>(N)) {
+      return false;
+    }
+    _jobs[b & (N - 1)].store(j, std::memory_order_relaxed);
+    _bottom.store(b + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Take the most recently pushed job, owner only. Returns nullptr if empty.
+  job *take() {
+    auto b = _bottom.load(std::memory_order_relaxed) - 1;
+    _bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto t = _top.load(std::memory_order_relaxed);
+    if (t > b) {
+      _bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    auto j = _jobs[b & (N - 1)].load(std::memory_order_relaxed);
+    if (t == b) {
+      // Last job, race the thieves for it
+      if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        j = nullptr;
+      }
+      _bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return j;
+  }
+
+  /// Steal the least recently pushed job. Returns nullptr if empty or lost.
+  job *steal() {
+    auto t = _top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto b = _bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+    auto j = _jobs[t & (N - 1)].load(std::memory_order_relaxed);
+    if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return j;
+  }
+};
+
+/// Start the worker threads, call from the main thread. Zero workers sizes the
+/// pool to the hardware, leaving a core for the main thread.
+void init(std::size_t = 0);
+
+/// Worker threads running, the main thread also runs jobs while it waits
+std::size_t workers();
+
+/// Queue a job on the calling thread's deque for any thread to run
+void push(job *);
+
+/// Queue a job that only the main thread may run (SDL, Lua)
+void push_main(job *);
+
+/// Run one queued job on the main thread. Returns false if none was found.
+bool run_one();
+
+/// Stop and join the worker threads
+void deinit();
+} // namespace jobs
+} // namespace celerygame
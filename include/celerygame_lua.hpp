@@ -18,14 +18,90 @@
 #include "celerygame_runloop.hpp"
 namespace celerygame {
 namespace lua {
-/// Initialises the Lua state with an init file
-void init(std::filesystem::path &&);
+/// Initialises the Lua state with an init file. Scripts are compiled to
+/// bytecode in the cache directory and loaded from there while they're
+/// unchanged, without one they're compiled every time. `require` finds
+/// modules next to the init file first.
+void init(std::filesystem::path &&, std::filesystem::path && = {});
 
+/// How far `celerygame.poll_event` got through a tick's events
+struct event_cursor {
+  U64 frame = 0;          ///< The frame whose events are being polled
+  std::size_t polled = 0; ///< Events polled so far in that frame
+};
+
+/// A task performing a Lua function, it quits when the function returns true
 class scripted_task : public runloop::task {
+  int _callback;        /**< Registry reference to the function, owned if set */
+  event_cursor _events; /**< Every task polls every event in a frame */
+
 public:
-  void perform() override;
+  /// Perform the init file's `celerygame.runloop_callback`
+  scripted_task();
+  /// Perform a function in a phase, taking over its registry reference
+  scripted_task(int, runloop::phase);
+  ~scripted_task() override;
+  void perform(const runloop::frame &) override;
+};
+
+/// How the Lua state's garbage is collected. The collector only runs at the
+/// end of a frame, stepping while there's time left before the deadline.
+struct collector {
+  F64 budget = 0.001;          ///< Most seconds to collect for per frame
+  int step = 64;               ///< Kilobytes of work per step, at least one
+  std::size_t floor = 4 << 20; ///< Bytes in use before it may run mid-frame
+};
+
+/// What the Lua state's memory is doing
+struct memory_stats {
+  std::size_t live;   ///< Bytes in use
+  std::size_t peak;   ///< Most bytes in use at once
+  std::size_t pooled; ///< Bytes of chunks carved into small blocks
+  U64 steps;          ///< Collector steps taken
+  U64 cycles;         ///< Collector cycles finished
+  U64 backlogs;       ///< Frames the collector ran uncapped to catch up
+  F64 collecting;     ///< Seconds spent stepping the collector
+};
+
+/// Memory allocated by the Lua state while a subsystem was running it. Lua
+/// frees in the collector, so only allocations can be charged.
+struct account_stats {
+  const char *name; ///< The subsystem
+  U64 allocations;  ///< Blocks allocated or grown
+  U64 bytes;        ///< Bytes allocated or grown by
 };
 
+/// Change how the Lua state's garbage is collected
+void set_collector(const collector &);
+
+/// Get how the Lua state's garbage is collected
+const collector &get_collector();
+
+/// Get what the Lua state's memory is doing
+memory_stats memory();
+
+/// Get the Lua state's memory charged to each subsystem
+std::vector<account_stats> accounts();
+
+/// Start sampling the Lua state's stacks every so many milliseconds with
+/// LuaJIT's profiler. Stopping writes the samples to the file as folded
+/// stacks for flamegraphs, and logs each function's self and total time.
+/// Returns false if it's already sampling or this LuaJIT can't.
+bool start_sampling(U32, std::filesystem::path &&);
+
+/// Stop sampling the Lua state, writing and logging what was sampled
+void stop_sampling();
+
+/// Is the Lua state being sampled?
+bool is_sampling();
+
+/// Log LuaJIT's trace compiler starting, stopping, aborting and blacklisting
+/// traces on the `jit` channel, counting them by where the traces start
+void watch_traces(bool);
+
+/// Log where the most traces aborted, and whether they were blacklisted
+void report_traces();
+
 /// Destroys the Lua state
 void deinit();
 } // namespace lua
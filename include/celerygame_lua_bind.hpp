@@ -0,0 +1,374 @@
+// Celerygame include for binding C++ functions to Lua
+//
+// Copyright 2021 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "celerygame.hpp"
+namespace celerygame {
+namespace lua {
+namespace bind {
+/// A struct field Lua sees by name
+template <class T, class M> struct member {
+  using type = M;
+  const char *name;
+  M T::*pointer;
+};
+
+/// Describe a struct field to Lua
+template <class T, class M>
+constexpr member<T, M> field(const char *name /**< [in] what Lua calls it */,
+                             M T::*pointer /**< [in] the field */) {
+  return member<T, M>{name, pointer};
+}
+
+/// Specialise with a `static constexpr auto value` tuple of `field`s to pass
+/// a struct to and from Lua as a table. Fields left out aren't seen by Lua.
+template <class T> struct members;
+
+template <class T, class = void> struct has_members : std::false_type {};
+template <class T>
+struct has_members<T, std::void_t<decltype(members<T>::value)>>
+    : std::true_type {};
+
+/// Converts between a C++ type and Lua values, specialise it for more types.
+/// Types reading tables cache their keys as upvalues of the binding's
+/// closure, `keys` of them starting at upvalue `key`, pushed by `push_keys`.
+template <class T, class = void> struct value;
+
+/// A stack index that stays put while values are pushed
+inline int absolute(lua_State *L0, int index) {
+  return index < 0 ? lua_gettop(L0) + index + 1 : index;
+}
+
+template <> struct value<bool> {
+  static constexpr int keys = 0;
+  static void push_keys(lua_State *) {}
+  static bool get(lua_State *L0, int index, int) {
+    return lua_toboolean(L0, index);
+  }
+  static void push(lua_State *L0, bool from, int) {
+    lua_pushboolean(L0, from);
+  }
+};
+
+template <class T>
+struct value<T, std::enable_if_t<std::is_integral_v<T> &&
+                                 !std::is_same_v<T, bool>>> {
+  static constexpr int keys = 0;
+  static void push_keys(lua_State *) {}
+  static T get(lua_State *L0, int index, int) {
+    // Only zero needs telling apart from a non-number
+    auto got = lua_tointeger(L0, index);
+    if (got == 0 && !lua_isnumber(L0, index)) {
+      luaL_typerror(L0, index, "integer");
+    }
+    return static_cast<T>(got);
+  }
+  static void push(lua_State *L0, T from, int) {
+    lua_pushinteger(L0, static_cast<lua_Integer>(from));
+  }
+};
+
+template <class T>
+struct value<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+  static constexpr int keys = 0;
+  static void push_keys(lua_State *) {}
+  static T get(lua_State *L0, int index, int) {
+    auto got = lua_tonumber(L0, index);
+    if (got == 0 && !lua_isnumber(L0, index)) {
+      luaL_typerror(L0, index, "number");
+    }
+    return static_cast<T>(got);
+  }
+  static void push(lua_State *L0, T from, int) {
+    lua_pushnumber(L0, static_cast<lua_Number>(from));
+  }
+};
+
+/// Enums pass as their underlying integer
+template <class T> struct value<T, std::enable_if_t<std::is_enum_v<T>>> {
+  using underlying = value<std::underlying_type_t<T>>;
+  static constexpr int keys = 0;
+  static void push_keys(lua_State *) {}
+  static T get(lua_State *L0, int index, int) {
+    return static_cast<T>(underlying::get(L0, index, 0));
+  }
+  static void push(lua_State *L0, T from, int) {
+    underlying::push(L0, static_cast<std::underlying_type_t<T>>(from), 0);
+  }
+};
+
+/// Pointers pass as light userdata, nil is nullptr
+template <class T> struct value<T *> {
+  static constexpr int keys = 0;
+  static void push_keys(lua_State *) {}
+  static T *get(lua_State *L0, int index, int) {
+    if (!lua_islightuserdata(L0, index) && !lua_isnil(L0, index)) {
+      luaL_typerror(L0, index, "light userdata");
+    }
+    return static_cast<T *>(lua_touserdata(L0, index));
+  }
+  static void push(lua_State *L0, T *from, int) {
+    lua_pushlightuserdata(
+        L0, const_cast<void *>(static_cast<const void *>(from)));
+  }
+};
+
+/// Strings are only valid while they're on the stack, for the call
+template <> struct value<const char *> {
+  static constexpr int keys = 0;
+  static void push_keys(lua_State *) {}
+  static const char *get(lua_State *L0, int index, int) {
+    return luaL_checkstring(L0, index);
+  }
+  static void push(lua_State *L0, const char *from, int) {
+    lua_pushstring(L0, from);
+  }
+};
+
+template <> struct value<std::string_view> {
+  static constexpr int keys = 0;
+  static void push_keys(lua_State *) {}
+  static std::string_view get(lua_State *L0, int index, int) {
+    auto size = std::size_t{0};
+    auto &&str = luaL_checklstring(L0, index, &size);
+    return std::string_view{str, size};
+  }
+  static void push(lua_State *L0, std::string_view from, int) {
+    lua_pushlstring(L0, from.data(), from.size());
+  }
+};
+
+template <> struct value<std::string> {
+  static constexpr int keys = 0;
+  static void push_keys(lua_State *) {}
+  static std::string get(lua_State *L0, int index, int) {
+    return std::string{value<std::string_view>::get(L0, index, 0)};
+  }
+  static void push(lua_State *L0, const std::string &from, int) {
+    lua_pushlstring(L0, from.data(), from.size());
+  }
+};
+
+/// Paths pass as strings
+template <> struct value<std::filesystem::path> {
+  static constexpr int keys = 0;
+  static void push_keys(lua_State *) {}
+  static std::filesystem::path get(lua_State *L0, int index, int) {
+    return std::filesystem::path{value<std::string_view>::get(L0, index, 0)};
+  }
+  static void push(lua_State *L0, const std::filesystem::path &from, int) {
+    value<std::string>::push(L0, from.string(), 0);
+  }
+};
+
+/// Vectors pass as arrays
+template <class T> struct value<std::vector<T>> {
+  static constexpr int keys = value<T>::keys;
+  static void push_keys(lua_State *L0) { value<T>::push_keys(L0); }
+  static std::vector<T> get(lua_State *L0, int index, int key) {
+    luaL_checktype(L0, index, LUA_TTABLE);
+    index = absolute(L0, index);
+    auto size = static_cast<int>(lua_objlen(L0, index));
+    auto got = std::vector<T>{};
+    got.reserve(size);
+    for (auto i = 1; i <= size; i++) {
+      lua_rawgeti(L0, index, i);
+      got.emplace_back(value<T>::get(L0, -1, key));
+      lua_pop(L0, 1);
+    }
+    return got;
+  }
+  static void push(lua_State *L0, const std::vector<T> &from, int key) {
+    lua_createtable(L0, static_cast<int>(from.size()), 0);
+    for (auto i = std::size_t{0}; i < from.size(); i++) {
+      value<T>::push(L0, from[i], key);
+      lua_rawseti(L0, -2, static_cast<int>(i + 1));
+    }
+  }
+};
+
+/// Structs with `members` pass as tables, fields missing from a table keep
+/// their defaults
+template <class T> struct value<T, std::enable_if_t<has_members<T>::value>> {
+  static constexpr auto count = std::tuple_size_v<
+      std::remove_cv_t<std::remove_reference_t<decltype(members<T>::value)>>>;
+  template <std::size_t I>
+  using field_type = typename std::remove_cv_t<std::remove_reference_t<
+      decltype(std::get<I>(members<T>::value))>>::type;
+
+  /// Keys the first fields' types need
+  template <std::size_t... I>
+  static constexpr int field_keys(std::index_sequence<I...>) {
+    return (0 + ... + value<field_type<I>>::keys);
+  }
+  /// Where a field's type's keys start, after this struct's own
+  template <std::size_t I> static constexpr int field_key(int key) {
+    return key + static_cast<int>(count) +
+           field_keys(std::make_index_sequence<I>{});
+  }
+
+  static constexpr int keys =
+      static_cast<int>(count) + field_keys(std::make_index_sequence<count>{});
+
+  static void push_keys(lua_State *L0) {
+    std::apply([L0](auto &&...field) { (lua_pushstring(L0, field.name), ...); },
+               members<T>::value);
+    std::apply(
+        [L0](auto &&...field) {
+          (value<typename std::remove_reference_t<decltype(field)>::type>::
+               push_keys(L0),
+           ...);
+        },
+        members<T>::value);
+  }
+
+  static T get(lua_State *L0, int index, int key) {
+    luaL_checktype(L0, index, LUA_TTABLE);
+    index = absolute(L0, index);
+    auto got = T{};
+    get_fields(L0, index, key, got, std::make_index_sequence<count>{});
+    return got;
+  }
+  template <std::size_t... I>
+  static void get_fields(lua_State *L0, int index, int key, T &got,
+                         std::index_sequence<I...>) {
+    (get_field<I>(L0, index, key, got), ...);
+  }
+  template <std::size_t I>
+  static void get_field(lua_State *L0, int index, int key, T &got) {
+    auto &&field = std::get<I>(members<T>::value);
+    lua_pushvalue(L0, lua_upvalueindex(key + static_cast<int>(I)));
+    lua_rawget(L0, index);
+    if (!lua_isnil(L0, -1)) {
+      got.*field.pointer =
+          value<field_type<I>>::get(L0, -1, field_key<I>(key));
+    }
+    lua_pop(L0, 1);
+  }
+
+  static void push(lua_State *L0, const T &from, int key) {
+    lua_createtable(L0, 0, static_cast<int>(count));
+    push_fields(L0, from, key, std::make_index_sequence<count>{});
+  }
+  template <std::size_t... I>
+  static void push_fields(lua_State *L0, const T &from, int key,
+                          std::index_sequence<I...>) {
+    (push_field<I>(L0, from, key), ...);
+  }
+  template <std::size_t I>
+  static void push_field(lua_State *L0, const T &from, int key) {
+    auto &&field = std::get<I>(members<T>::value);
+    lua_pushvalue(L0, lua_upvalueindex(key + static_cast<int>(I)));
+    value<field_type<I>>::push(L0, from.*field.pointer, field_key<I>(key));
+    lua_rawset(L0, -3);
+  }
+};
+
+template <class T>
+using value_of = value<std::remove_cv_t<std::remove_reference_t<T>>>;
+
+/// Pushes what a bound function returns, tuples as one result per element
+template <class T> struct returned {
+  static constexpr int keys = value_of<T>::keys;
+  static void push_keys(lua_State *L0) { value_of<T>::push_keys(L0); }
+  static int push(lua_State *L0, const T &from, int key) {
+    value_of<T>::push(L0, from, key);
+    return 1;
+  }
+};
+
+template <> struct returned<void> {
+  static constexpr int keys = 0;
+  static void push_keys(lua_State *) {}
+};
+
+template <class... T> struct returned<std::tuple<T...>> {
+  static_assert((... && (value_of<T>::keys == 0)),
+                "Tuples can only return values that don't read tables");
+  static constexpr int keys = 0;
+  static void push_keys(lua_State *) {}
+  static int push(lua_State *L0, const std::tuple<T...> &from, int) {
+    std::apply(
+        [L0](auto &&...element) {
+          (value_of<decltype(element)>::push(L0, element, 0), ...);
+        },
+        from);
+    return static_cast<int>(sizeof...(T));
+  }
+};
+
+/// A function as a `lua_CFunction`, its arguments starting at `First`
+template <auto F, int First> struct binding;
+
+template <class R, class... A, R (*F)(A...), int First>
+struct binding<F, First> {
+  /// Where each argument's keys start, then the return value's, then the end
+  static constexpr auto keys = [] {
+    auto starts = std::array<int, sizeof...(A) + 2>{};
+    auto key = 1;
+    auto i = std::size_t{0};
+    ((starts[i++] = key, key += value_of<A>::keys), ...);
+    starts[i++] = key;
+    starts[i] = key + returned<R>::keys;
+    return starts;
+  }();
+  // LuaJIT caps a closure's upvalues
+  static_assert(keys.back() - 1 <= 60, "Too many table keys to cache");
+
+  template <std::size_t... I>
+  static int invoke(lua_State *L0, std::index_sequence<I...>) {
+    if constexpr (std::is_void_v<R>) {
+      F(value_of<A>::get(L0, First + static_cast<int>(I), keys[I])...);
+      return 0;
+    } else {
+      return returned<R>::push(
+          L0, F(value_of<A>::get(L0, First + static_cast<int>(I), keys[I])...),
+          keys[sizeof...(A)]);
+    }
+  }
+
+  static int call(lua_State *L0) {
+    // Lua errors can't be raised from inside the handler
+    try {
+      return invoke(L0, std::index_sequence_for<A...>{});
+    } catch (const std::exception &e) {
+      lua_pushstring(L0, e.what());
+    }
+    return lua_error(L0);
+  }
+
+  static void push(lua_State *L0) {
+    (value_of<A>::push_keys(L0), ...);
+    returned<R>::push_keys(L0);
+    lua_pushcclosure(L0, &call, keys.back() - 1);
+  }
+};
+
+/// Push a C++ function as a Lua function
+template <auto F> void push(lua_State *L0 /**< [in] the Lua state */) {
+  binding<F, 1>::push(L0);
+}
+
+/// Add a C++ function to the table on top of the stack as a method, called
+/// with `:` so its arguments start after the table
+template <auto F>
+void method(lua_State *L0 /**< [in] the Lua state */,
+            const char *name /**< [in] the method's name */) {
+  binding<F, 2>::push(L0);
+  lua_setfield(L0, -2, name);
+}
+} // namespace bind
+} // namespace lua
+} // namespace celerygame
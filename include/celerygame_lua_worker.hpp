@@ -0,0 +1,110 @@
+// Celerygame include for Lua worker states
+//
+// Copyright 2021 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "celerygame.hpp"
+namespace celerygame {
+namespace lua {
+/// A Lua value serialized once, immutable from then on. Whoever it's sent to
+/// shares the same bytes.
+class message {
+  std::vector<U8> _bytes;
+
+public:
+  explicit message(std::vector<U8> &&);
+  std::span<const U8> bytes() const; /**< The serialized value */
+  /// The string's bytes if the value is a string, empty otherwise
+  std::string_view blob() const;
+};
+
+/// A message as it's passed around
+using shared_message = std::shared_ptr<const message>;
+
+/// Messages each mailbox holds before posting fails
+constexpr auto mailbox_capacity = std::size_t{1024};
+
+/// A ring of messages, one thread posts and one other thread takes
+template <std::size_t N> class mailbox {
+  static_assert((N & (N - 1)) == 0, "Mailbox capacity must be a power of two");
+  alignas(64) std::atomic<U64> _head; ///< Next slot to take from
+  alignas(64) std::atomic<U64> _tail; ///< Next slot to post to
+  alignas(64) std::array<shared_message, N> _slots;
+
+public:
+  mailbox() : _head{0}, _tail{0} {}
+  mailbox(const mailbox &) = delete;
+  mailbox &operator=(const mailbox &) = delete;
+
+  /// Post a message, posting thread only. Returns false if full.
+  bool post(shared_message m /**< [in] the message */) {
+    auto t = _tail.load(std::memory_order_relaxed);
+    if (t - _head.load(std::memory_order_acquire) >= N) {
+      return false;
+    }
+    _slots[t & (N - 1)] = std::move(m);
+    _tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Take the oldest message, taking thread only. Returns nullptr if empty.
+  shared_message take() {
+    auto h = _head.load(std::memory_order_relaxed);
+    if (h == _tail.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    auto m = std::move(_slots[h & (N - 1)]);
+    _head.store(h + 1, std::memory_order_release);
+    return m;
+  }
+};
+
+/// Serialize the value at a stack index, nil, booleans, numbers, strings and
+/// tables of them. Messages are sent on as they are. Throws for anything else.
+shared_message encode(lua_State *, int);
+
+/// Push a message as a userdata, read with `:value()`, or `:blob()` for a
+/// pointer to a string's bytes and their size, to view through the FFI
+void push(lua_State *, shared_message);
+
+namespace workers {
+/// Start worker threads, each running a script in a Lua state of its own. The
+/// script sets `worker.on_message`, called with each message posted to it.
+/// `worker.id` tells workers apart, `worker.post` posts to the main state.
+void init(std::size_t, std::filesystem::path &&);
+
+/// Worker threads running
+std::size_t count();
+
+/// Post a message to a worker, main thread only. Returns false if its
+/// mailbox is full.
+bool post(std::size_t, shared_message);
+
+/// Post a message to every worker, main thread only. Returns how many took
+/// it.
+std::size_t broadcast(const shared_message &);
+
+/// Take a message a worker posted to the main state, and which worker it
+/// was. Returns false if there are none. Main thread only.
+bool receive(std::size_t &, shared_message &);
+
+/// Add the message metatable to a state, and the main state's methods for
+/// workers to the table on top of its stack
+void bind(lua_State *);
+
+/// Stop the worker threads once they've handled what was posted to them
+void deinit();
+} // namespace workers
+} // namespace lua
+} // namespace celerygame
@@ -0,0 +1,65 @@
+// Celerygame include for the zone profiler
+//
+// Copyright 2021 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "celerygame.hpp"
+namespace celerygame {
+namespace profiler {
+/// Start recording zones, the trace is written to the path on `deinit`
+void init(std::filesystem::path &&);
+
+/// Is the profiler recording zones?
+bool enabled();
+
+/// Nanoseconds on the profiler's clock
+U64 now();
+
+/// Record a finished zone on this thread's buffer
+void record(const char *, U64, U64);
+
+/// Open a zone on this thread, for callers that can't use `zone` (Lua)
+void begin(const char *);
+
+/// Close the innermost zone opened with `begin` on this thread
+void end();
+
+/// Get a name that lives as long as the profiler, for transient strings
+const char *intern(std::string_view);
+
+/// Write the Chrome trace-event file and stop recording zones
+void deinit();
+
+/// A profiling zone covering the scope it lives in, allocates nothing
+class zone {
+  const char *_name;
+  U64 _start;
+
+public:
+  /// Open a zone, `name` must outlive the profiler (literals, `intern`)
+  explicit zone(const char *name) : _name{name}, _start{0} {
+    if (enabled()) {
+      _start = now();
+    }
+  }
+  ~zone() {
+    if (_start != 0) {
+      record(_name, _start, now());
+    }
+  }
+  zone(const zone &) = delete;
+  zone &operator=(const zone &) = delete;
+};
+} // namespace profiler
+} // namespace celerygame
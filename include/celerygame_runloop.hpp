@@ -15,30 +15,297 @@
 // limitations under the License.
 #pragma once
 #include "celerygame.hpp"
+#include "celerygame_jobs.hpp"
 namespace celerygame {
 namespace runloop {
+/// Where in a frame a task runs, phases run in this order
+enum class phase : U8 {
+  input,    ///< Once per frame, before simulating
+  simulate, ///< Zero or more times per frame, once per fixed timestep
+  render,   ///< Once per frame, interpolating between simulation steps
+  present   ///< Once per frame, last
+};
+
+/// What a task is told about the frame it runs in
+struct frame {
+  U64 number;   ///< Frames ticked so far
+  F64 timestep; ///< Seconds simulated by each simulation step
+  U32 steps;    ///< Simulation steps this frame, so far during `simulate`
+  F32 alpha;    ///< How far into the next step rendering is, from 0 to 1
+};
+
+/// An SDL event trimmed down to what tasks use, pumped once per tick. Which
+/// fields mean something depends on the type.
+struct event {
+  U32 type;      ///< The SDL event type
+  U32 timestamp; ///< SDL ticks when it was queued
+  U32 window;    ///< ID of the window it happened in, 0 if none
+  S32 code;      ///< Scancode, mouse button, or window event
+  S32 key;       ///< Keycode
+  S32 x;         ///< Mouse or wheel X, first window event datum
+  S32 y;         ///< Mouse or wheel Y, second window event datum
+  S32 dx;        ///< Relative mouse motion in X
+  S32 dy;        ///< Relative mouse motion in Y
+  U16 modifiers; ///< Key modifiers held
+  U8 state;      ///< Pressed or released, or the mouse buttons held
+  U8 repeats;    ///< Key repeat, or mouse click count
+};
+
+/// Which threads may perform a task
+enum class affinity : U8 {
+  any,        ///< Any job worker, the task must be thread safe
+  main_thread ///< Only the main thread, for tasks touching SDL or Lua
+};
+
 /// Stub task for time triggered run loop
 class task {
 protected:
   bool _shall_quit =
       false; /**< Set to true then the next tick deletes this task */
+  phase _phase;       /**< When this task runs in a frame */
+  affinity _affinity; /**< Which threads may perform it */
 public:
-  bool should_quit() const; /**< Will this task be deleted? */
-  virtual void perform();   /**< Performs the task */
+  explicit task(phase = phase::input, affinity = affinity::main_thread);
+  bool should_quit() const;            /**< Will this task be deleted? */
+  phase when() const;                  /**< When does this task run? */
+  affinity where() const;              /**< Which threads may run it? */
+  virtual void perform(const frame &); /**< Performs the task */
   virtual ~task();
 };
 
-/// A data structure for storing time-triggered tasks (runs per loop cycle)
-using tasks_t = std::forward_list<std::unique_ptr<task>>;
+/// A task as a plain function, passed its context. Returns true when the task
+/// should be deleted.
+using function_t = bool (*)(void *, const frame &);
+
+/// Refers to a task in the run loop. Stays valid while the task's in the run
+/// loop, and never refers to another task after it's gone.
+struct handle {
+  U32 index;      ///< Slot in the run loop's registry
+  U32 generation; ///< Which task to have used the slot
+  bool operator==(const handle &other) const {
+    return index == other.index && generation == other.generation;
+  }
+  bool operator!=(const handle &other) const { return !(*this == other); }
+};
+
+/// A timer's callback, passed its context
+using timer_function_t = void (*)(void *);
+
+/// Refers to a pending timer, never refers to another timer after it's gone
+struct timer {
+  U32 index;      ///< Slot in the timer pool
+  U32 generation; ///< Which timer to have used the slot
+};
+
+/// Get memory for a coroutine frame from the run loop's pool, main thread only
+void *allocate_frame(std::size_t);
+
+/// Return a coroutine frame's memory to the run loop's pool
+void free_frame(void *, std::size_t);
+
+/// Game logic as a coroutine, resumed by the run loop on the main thread at
+/// the start of a tick, after timers. Return it from a function that uses
+/// `co_await`, then hand it to `spawn`. While suspended it costs nothing.
+class coroutine {
+public:
+  struct promise_type {
+    std::exception_ptr failure = nullptr; ///< Rethrown from `tick`
+    promise_type *prev = nullptr;         ///< Spawned coroutines' list
+    promise_type *next = nullptr;         ///< Spawned coroutines' list
+
+    coroutine get_return_object() {
+      return coroutine{
+          std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { failure = std::current_exception(); }
+    static void *operator new(std::size_t size) {
+      return allocate_frame(size);
+    }
+    static void operator delete(void *frame, std::size_t size) {
+      free_frame(frame, size);
+    }
+  };
+  using handle_t = std::coroutine_handle<promise_type>;
+
+  explicit coroutine(handle_t);
+  coroutine(coroutine &&) noexcept;
+  coroutine &operator=(coroutine &&) noexcept;
+  ~coroutine();       /**< Destroys the coroutine unless it was spawned */
+  handle_t release(); /**< Give up ownership of the coroutine */
+
+private:
+  handle_t _handle;
+};
+
+/// Awaits the next tick
+struct next_tick_awaiter {
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(coroutine::handle_t);
+  void await_resume() noexcept {}
+};
+
+/// Awaits a duration on the run loop's timers
+struct sleep_awaiter {
+  F64 seconds;
+  bool await_ready() const noexcept { return seconds <= 0.0; }
+  void await_suspend(coroutine::handle_t);
+  void await_resume() noexcept {}
+};
+
+/// Awaits a job on the job system, resuming at the first tick after it ran
+struct job_awaiter {
+  jobs::job work;              ///< The job to run
+  jobs::job job;               ///< Runs `work` then queues the resume
+  coroutine::handle_t waiting; ///< Resumed once `work` ran
+  std::exception_ptr failure;  ///< Thrown by `work`, rethrown on resume
+  bool await_ready() const noexcept { return false; }
+  bool await_suspend(coroutine::handle_t);
+  void await_resume();
+};
+
+/// How the run loop paces frames. Idling is off by default, turn it on when
+/// the game is paused or minimized. While it's on, tasks with work pending
+/// have to call `keep_awake`.
+struct schedule {
+  F64 simulation_rate = 60.0; ///< Simulation steps per second
+  F64 frame_rate = 144.0;     ///< Target frames per second, 0 is uncapped
+  U32 max_steps = 5;          ///< Most simulation steps to catch up per frame
+  F64 spin = 0.002;           ///< Seconds before a deadline to stop sleeping
+  bool measure_tasks = true;  ///< Time every task's `perform`
+  F64 report_interval = 0.0;  ///< Seconds between task stat reports, 0 is off
+  bool idle = false;          ///< Wait for events unless kept awake
+  F64 idle_delay = 0.5;       ///< Seconds without activity before idling
+};
+
+/// How long a task's recent performs took, in seconds
+struct task_stats {
+  handle task;      ///< The task measured
+  const char *name; ///< The name it was added with
+  phase when;       ///< When it runs in a frame
+  U64 performs;     ///< Performs measured so far
+  F64 p50;          ///< Median of the recent performs
+  F64 p95;          ///< 95th percentile of the recent performs
+  F64 p99;          ///< 99th percentile of the recent performs
+  F64 max;          ///< Slowest of the recent performs
+  F64 budget;       ///< Time it may take per frame, 0 is unlimited
+  U64 overruns;     ///< Frames it went over its budget
+};
+
+/// How far frames landed from their deadlines, in seconds
+struct jitter {
+  U64 frames; ///< Frames measured
+  F64 mean;   ///< Mean absolute pacing error
+  F64 max;    ///< Worst absolute pacing error
+};
 
 /// Initialize the run loop infrastructure
 void init();
 
-/// Main run loop tick handler. Returns false if the run loop should quit.
+/// Main run loop tick handler, runs then paces one frame. Each phase's tasks
+/// run in parallel on the job system as their dependencies finish, and this
+/// returns once they all have. Without activity for a while it waits for the
+/// next event or timer instead of pacing. Returns false if the run loop
+/// should quit.
 bool tick();
 
-/// Get all tasks in the run loop
-tasks_t *const tasks();
+/// Add a task to the run loop, the run loop owns it from now on. Call from
+/// the main thread, tasks added during a tick start running next tick. The
+/// name is for stats and has to outlive the task, like a literal.
+handle add(std::unique_ptr<task> &&, const char * = "task");
+
+/// Add a plain function task to the run loop. `context` has to outlive it.
+handle add(phase, function_t, void *, affinity = affinity::main_thread,
+           const char * = "function");
+
+/// Delete a task once the current tick finishes, or now outside of a tick
+void remove(handle);
+
+/// Is this task still in the run loop?
+bool contains(handle);
+
+/// Get a task object, nullptr for plain functions and deleted tasks
+task *get(handle);
+
+/// Finish the second task before performing the first each frame. It can't
+/// run in a later phase, and the dependency can't form a cycle.
+void depends_on(handle, handle);
+
+/// Tasks in the run loop
+std::size_t count();
+
+/// Call a function on the main thread after a delay in seconds, before the
+/// input phase of the tick it's due in. With a period it's called again every
+/// period until cancelled, catching up at most once after a long frame.
+/// Timers have millisecond resolution.
+timer start_timer(F64, F64, timer_function_t, void *);
+
+/// Cancel a timer. Returns false if it already fired or was cancelled.
+bool cancel_timer(timer);
+
+/// Timers waiting to fire
+std::size_t pending_timers();
+
+/// Start running a coroutine from the next tick, the run loop owns it now
+void spawn(coroutine &&);
+
+/// Suspend a coroutine until the next tick
+next_tick_awaiter next_tick();
+
+/// Suspend a coroutine for a while, with millisecond resolution
+sleep_awaiter sleep_for(std::chrono::duration<F64>);
+
+/// Suspend a coroutine while a job runs on the job system. Without job
+/// workers the job runs right away instead.
+job_awaiter run_job(jobs::job);
+
+/// Spawned coroutines that haven't finished
+std::size_t running_coroutines();
+
+/// The frame being ticked, or the last one ticked between ticks. It lives as
+/// long as the run loop, so it can be read through a pointer.
+const frame &current();
+
+/// This tick's SDL events, pumped before anything else runs. Every task sees
+/// all of them, they're valid until the next tick.
+std::span<const event> events();
+
+/// Report that there's work to do, keeping the run loop from idling. Safe to
+/// call from any thread, it wakes the run loop up if it's idling.
+void keep_awake();
+
+/// Is the run loop waiting for events rather than ticking at full rate?
+bool idling();
+
+/// Seconds left before the current frame's deadline, 0 when it's late.
+/// Without a frame rate cap there's no deadline, and it's infinite.
+F64 slack();
+
+/// Let a task take this many seconds per frame before warning, 0 is unlimited
+void set_budget(handle, F64);
+
+/// Get how long a task's recent performs took
+task_stats stats(handle);
+
+/// Get how long every task's recent performs took
+std::vector<task_stats> all_stats();
+
+/// Log every task's stats at informational priority
+void report();
+
+/// Get a phase's name
+const char *phase_name(phase);
+
+/// Change how the run loop paces frames
+void set_schedule(const schedule &);
+
+/// Get how the run loop paces frames
+const schedule &get_schedule();
+
+/// Get the frame pacing error measured since the last call, then reset it
+jitter measure_jitter();
 
 /// Cleanup the run loop infrastructure
 void deinit();
@@ -26,8 +26,9 @@ std::string stringify_version_info(U32);
 template <class T> T procaddr_cast(const char *name) {
   auto pfn = reinterpret_cast<T>(vkGetInstanceProcAddr(*vulkan::instance::get(), name));
   if (pfn == nullptr) {
-    console::log(console::priority::warning,
-                 "procaddr_cast can't find Vulkan function: '", name, "'\n");
+    console::log(console::channel::vulkan, console::priority::warning,
+                 "procaddr_cast can't find Vulkan function: '"_literal, name,
+                 "'\n"_literal);
   }
   return pfn;
 }
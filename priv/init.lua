@@ -2,18 +2,16 @@ celerygame.app = "whatever"
 celerygame.vsn = 8192
 
 function celerygame.init_callback()
-    celerygame:init_vulkan()
+    celerygame:init_vulkan(celerygame.app, celerygame.vsn)
 end
 
+local quit = celerygame.event_types.quit
+
 function celerygame.runloop_callback()
-    while true do
-        local event = celerygame:poll_event()
-        if event then
-            if event.type == "quit" then
-                return true
-            end
-        else
-            break
+    local events, count = celerygame:event_view()
+    for i = 0, count - 1 do
+        if events[i].type == quit then
+            return true
         end
     end
     return false
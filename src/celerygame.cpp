@@ -16,34 +16,59 @@
 #include "../include/celerygame.hpp"
 #include "../include/celerygame_cfg.hpp"
 #include "../include/celerygame_console.hpp"
+#include "../include/celerygame_jobs.hpp"
 #include "../include/celerygame_lua.hpp"
+#include "../include/celerygame_profiler.hpp"
 #include "../include/celerygame_runloop.hpp"
 #include "../include/celerygame_vulkan_getset.hpp"
 #include "../include/celerygame_vulkan_instance.hpp"
 #include "../include/celerygame_vulkan_utils.hpp"
 #include "../include/celerygame_vulkan_window.hpp"
 
+using namespace celerygame::console::literals;
+
 int main(int argc, char **argv) {
   SDL_Init(SDL_INIT_EVERYTHING);
   celerygame::console::init();
 
-  celerygame::console::set_priority(celerygame::console::priority::debug);
-
   celerygame::console::listeners()->emplace_back(
       new celerygame::console::terminal_listener{});
   celerygame::console::listeners()->emplace_back(
-      new celerygame::console::file_listener{"console.log"});
+      new celerygame::console::async_file_listener{
+          "console.log", celerygame::console::overflow_policy::count});
+  celerygame::console::listeners()->emplace_back(
+      new celerygame::console::flight_recorder_listener{"flight_recorder.log"});
+  // Sets the listeners added so far, add any that should differ afterwards
+  celerygame::console::set_priority(celerygame::console::priority::debug);
 
-  celerygame::console::log(celerygame::console::priority::notice, "Celerygame ",
-                           celerygame_VSTRING_FULL, "\n");
+  celerygame::console::log(celerygame::console::priority::notice,
+                           "Celerygame "_literal, celerygame_VSTRING_FULL,
+                           "\n"_literal);
+
+  // Set CELERYGAME_TRACE to a path to record a Chrome trace-event file
+  if (auto trace = std::getenv("CELERYGAME_TRACE"); trace != nullptr) {
+    celerygame::profiler::init(trace);
+  }
 
   auto status = EXIT_FAILURE;
   try {
+    celerygame::jobs::init();
     celerygame::runloop::init();
-    celerygame::runloop::tasks()->emplace_front(
-        dynamic_cast<celerygame::runloop::task *>(
-            new celerygame::lua::scripted_task));
-    celerygame::lua::init(std::filesystem::path{"priv"} / "init.lua");
+    celerygame::runloop::add(
+        std::make_unique<celerygame::lua::scripted_task>(), "lua::runloop");
+    celerygame::lua::init(std::filesystem::path{"priv"} / "init.lua",
+                          std::filesystem::path{"cache"} / "lua");
+    // Set CELERYGAME_LUA_SAMPLES to a path to sample Lua's stacks every
+    // millisecond, written as folded stacks when Lua closes
+    if (auto samples = std::getenv("CELERYGAME_LUA_SAMPLES");
+        samples != nullptr) {
+      celerygame::lua::start_sampling(1, samples);
+    }
+    // Set CELERYGAME_LUA_TRACES to log LuaJIT's traces on the jit channel,
+    // reporting where they aborted when Lua closes
+    if (std::getenv("CELERYGAME_LUA_TRACES") != nullptr) {
+      celerygame::lua::watch_traces(true);
+    }
     // celerygame::vulkan::init();
     // celerygame::vulkan::window::init(
     //     APP_NAME +
@@ -52,13 +77,13 @@ int main(int argc, char **argv) {
     // celerygame::vulkan::instance::init(APP_NAME, APP_VERS, true, {}, {});
 
     while (celerygame::runloop::tick()) {
-      SDL_Delay(10);
     }
 
     status = EXIT_SUCCESS;
   } catch (const std::exception &e) {
     celerygame::console::log(celerygame::console::priority::alert,
-                             "Fatal error: ", e.what(), "\n");
+                             "Fatal error: "_literal, e.what(), "\n"_literal);
+    celerygame::console::flush();
   }
 
   // celerygame::vulkan::instance::deinit();
@@ -66,6 +91,8 @@ int main(int argc, char **argv) {
   // celerygame::vulkan::deinit();
   celerygame::lua::deinit();
   celerygame::runloop::deinit();
+  celerygame::jobs::deinit();
+  celerygame::profiler::deinit();
   celerygame::console::deinit();
   SDL_Quit();
   return status;
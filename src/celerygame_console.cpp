@@ -14,113 +14,564 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "../include/celerygame_console.hpp"
+#include <csignal>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 using namespace celerygame;
 
 static auto all_listeners = std::unique_ptr<console::listeners_t>{nullptr};
 static auto current_priority = console::priority::debug;
 
-void console::set_priority(priority p) { current_priority = p; }
+void console::set_priority(priority p) {
+  current_priority = p;
+  if (all_listeners == nullptr) {
+    return;
+  }
+  for (auto &&listener : *all_listeners) {
+    listener->set_priorities(up_to(p));
+  }
+}
 console::priority console::get_priority() { return current_priority; }
 
-std::string common_prelude(console::priority p) {
-  // Formatter for string outputs
-  auto formatter = std::stringstream{};
-  formatter << "[";
+bool console::wants(channel c /**< [in] the channel of the line */,
+                    priority p /**< [in] the severity of the line */) {
+  if (static_cast<U8>(compiled_priority) < static_cast<U8>(p) ||
+      all_listeners == nullptr) {
+    return false;
+  }
+  for (auto &&listener : *all_listeners) {
+    if (listener->accepts(p, c)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// The "HH:MM:SS" part of the timestamp only changes once a second
+struct clock_cache {
+  std::time_t second = -1;
+  char text[9]{0x00};
+};
+static thread_local auto cached_clock = clock_cache{};
+
+console::prelude::prelude(priority p /**< [in] the severity of the line */) {
   // What is the current time?
   auto now = std::chrono::system_clock::now();
   // Convert that to a time_t
   auto now_ti = std::chrono::system_clock::to_time_t(now);
-  // Has to be stored in a fancyfied buffer
-  char now_buf[64]{0x00};
-  std::strftime(now_buf, sizeof(char) * 63, "%T", std::localtime(&now_ti));
+  if (now_ti != cached_clock.second) {
+    auto now_tm = std::tm{};
+#ifdef _WIN32
+    localtime_s(&now_tm, &now_ti);
+#else
+    localtime_r(&now_ti, &now_tm);
+#endif
+    std::strftime(cached_clock.text, sizeof(cached_clock.text), "%T", &now_tm);
+    cached_clock.second = now_ti;
+  }
   // Milliseconds are good to have
   auto milli = std::chrono::duration_cast<std::chrono::milliseconds>(
                    now.time_since_epoch())
                    .count() %
                1000;
-  // Time for formatting time
-  formatter << now_buf;
-  formatter << ".";
-  formatter << std::setw(3) << std::setfill('0') << milli;
-  formatter << std::setw(0) << std::setfill(' ') << "] ";
 
-  switch (p) {
-  case console::priority::emergency: {
-    formatter << "[ EMG ] ";
-    break;
+  text[0] = '[';
+  std::memcpy(text + 1, cached_clock.text, 8);
+  text[9] = '.';
+  text[10] = static_cast<char>('0' + milli / 100);
+  text[11] = static_cast<char>('0' + milli / 10 % 10);
+  text[12] = static_cast<char>('0' + milli % 10);
+  text[13] = ']';
+  text[14] = ' ';
+  std::memcpy(text + 15,
+              format::priority_tags[format::priority_index(static_cast<U8>(p))],
+              9);
+}
+
+void console::terminal_listener::finalize(priority p,
+                                          std::string_view str) {
+  std::fwrite(str.data(), sizeof(char), str.size(), stderr);
+}
+
+void console::terminal_listener::flush() { std::fflush(stderr); }
+
+console::file_listener::file_listener(
+    std::filesystem::path
+        &&file_path /**< [in] the path to the log file to write */)
+    : _file{std::fopen(file_path.string().c_str(), "w")} {
+  if (_file == nullptr) {
+    throw std::runtime_error{"Couldn't open log file for write."};
   }
-  case console::priority::alert: {
-    formatter << "[ ALT ] ";
-    break;
+}
+
+void console::file_listener::finalize(priority p, std::string_view str) {
+  std::fwrite(str.data(), sizeof(char), str.size(), _file);
+}
+
+void console::file_listener::flush() { std::fflush(_file); }
+
+console::file_listener::~file_listener() { std::fclose(_file); }
+
+console::rotating_file_listener::rotating_file_listener(
+    std::filesystem::path
+        &&file_path /**< [in] the path to the current log segment */,
+    std::size_t segment_size /**< [in] bytes preallocated per segment */,
+    U32 segments_kept /**< [in] how many full segments to keep around */)
+    : _path{std::move(file_path)}, _segment_size{segment_size},
+      _segments_kept{segments_kept} {
+  if (_segment_size == 0) {
+    throw std::runtime_error{"Log segments can't be empty."};
   }
-  case console::priority::critical: {
-    formatter << "[ CRT ] ";
-    break;
+  open_segment();
+}
+
+/// Where the nth old segment lives, the current segment is 0
+std::filesystem::path
+console::rotating_file_listener::segment_path(U32 n) const {
+  if (n == 0) {
+    return _path;
   }
-  case console::priority::error: {
-    formatter << "[ ERR ] ";
-    break;
+  auto path = _path;
+  path.replace_extension(std::to_string(n) + _path.extension().string());
+  return path;
+}
+
+void console::rotating_file_listener::open_segment() {
+#ifdef _WIN32
+  throw std::runtime_error{"Rotating log files need POSIX mmap."};
+#else
+  _descriptor =
+      ::open(_path.string().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (_descriptor < 0) {
+    _descriptor = -1;
+    throw std::runtime_error{"Couldn't open log file for write."};
   }
-  case console::priority::warning: {
-    formatter << "[ WRN ] ";
-    break;
+  // Reserve the blocks up front so writing never has to allocate them,
+  // not every filesystem can so a sparse file will have to do there.
+#ifdef __linux__
+  auto reserved = ::fallocate(_descriptor, 0, 0, _segment_size) == 0;
+#else
+  auto reserved = false;
+#endif
+  if (!reserved && ::ftruncate(_descriptor, _segment_size) != 0) {
+    ::close(_descriptor);
+    _descriptor = -1;
+    throw std::runtime_error{"Couldn't preallocate a log segment."};
   }
-  case console::priority::notice: {
-    formatter << "[ NOT ] ";
-    break;
+  auto map = ::mmap(nullptr, _segment_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, _descriptor, 0);
+  if (map == MAP_FAILED) {
+    ::close(_descriptor);
+    _descriptor = -1;
+    throw std::runtime_error{"Couldn't map a log segment."};
   }
-  case console::priority::informational: {
-    formatter << "[ INF ] ";
-    break;
+  _map = static_cast<char *>(map);
+  _used = 0;
+#endif
+}
+
+void console::rotating_file_listener::close_segment() {
+#ifndef _WIN32
+  ::munmap(_map, _segment_size);
+  // Don't leave the unused, zeroed tail in the file
+  if (::ftruncate(_descriptor, _used) != 0) {
+    std::fprintf(stderr, "Couldn't trim log segment '%s'.\n",
+                 _path.string().c_str());
   }
-  case console::priority::debug: {
-    formatter << "[ DBG ] ";
-    break;
+  ::close(_descriptor);
+  _map = nullptr;
+  _descriptor = -1;
+#endif
+}
+
+void console::rotating_file_listener::finalize(priority p,
+                                               std::string_view str) {
+  auto lock = std::lock_guard<std::mutex>{_mutex};
+  // A segment failed to open, so there's nowhere to write
+  if (_map == nullptr) {
+    return;
   }
+  if (_used + str.size() > _segment_size) {
+    close_segment();
+    // Only renames from here, the error codes keep a missing segment quiet
+    auto error = std::error_code{};
+    std::filesystem::remove(segment_path(_segments_kept), error);
+    for (auto n = _segments_kept; n > 0; n--) {
+      std::filesystem::rename(segment_path(n - 1), segment_path(n), error);
+    }
+    // Logging can't throw, so give up on this listener instead
+    try {
+      open_segment();
+    } catch (const std::exception &e) {
+      _used = 0;
+      std::fprintf(stderr, "Dropping lines for '%s': %s\n",
+                   _path.string().c_str(), e.what());
+      return;
+    }
   }
-  return formatter.str();
+  auto length = std::min(str.size(), _segment_size);
+  std::memcpy(_map + _used, str.data(), length);
+  _used += length;
 }
 
-void console::log_namespace(std::string &&name,
-                            std::function<void(std::string &)> &&block) {
-  console::log(console::priority::debug, "entering '", name, "'\n");
-  block(name);
-  console::log(console::priority::debug, "exiting '", name, "'\n");
+void console::rotating_file_listener::flush() {
+#ifndef _WIN32
+  auto lock = std::lock_guard<std::mutex>{_mutex};
+  if (_map != nullptr) {
+    ::msync(_map, _segment_size, MS_ASYNC);
+  }
+#endif
 }
 
-void console::terminal_listener::prelude(
-    std::string &str /**< [in] string to log */,
-    console::priority p /**< [in] the severity of the line to output */) {
-  str += common_prelude(p);
+console::rotating_file_listener::~rotating_file_listener() {
+  if (_map != nullptr) {
+    close_segment();
+  }
 }
 
-void console::terminal_listener::finalize(std::string &str) {
-  std::fprintf(stderr, "%s", str.c_str());
+// The flight recorder that gets dumped when we crash
+static auto crash_recorder =
+    std::atomic<console::flight_recorder_listener *>{nullptr};
+// Signals that mean we're about to die
+static constexpr int fatal_signals[] = {SIGSEGV, SIGABRT, SIGFPE, SIGILL};
+
+static void dump_on_fatal_signal(int signal_number) {
+  auto recorder = crash_recorder.load();
+  if (recorder != nullptr) {
+    recorder->dump();
+  }
+  std::signal(signal_number, SIG_DFL);
+  std::raise(signal_number);
 }
 
-console::file_listener::file_listener(
+console::flight_recorder_listener::flight_recorder_listener(
+    std::filesystem::path &&dump_path /**< [in] the file to dump lines to */,
+    U32 lines /**< [in] lines to keep, rounded up to a power of two */)
+    : _descriptor{::open(dump_path.string().c_str(),
+                         O_WRONLY | O_CREAT | O_APPEND, 0644)} {
+  if (_descriptor < 0) {
+    throw std::runtime_error{"Couldn't open flight recorder dump for write."};
+  }
+  auto capacity = U64{1};
+  while (capacity < lines) {
+    capacity <<= 1;
+  }
+  _mask = capacity - 1;
+  _slots = std::unique_ptr<slot[]>{new slot[capacity]};
+  for (auto i = U64{0}; i < capacity; i++) {
+    _slots[i].sequence.store(0, std::memory_order_relaxed);
+  }
+
+  crash_recorder.store(this);
+  for (auto signal_number : fatal_signals) {
+    std::signal(signal_number, dump_on_fatal_signal);
+  }
+}
+
+void console::flight_recorder_listener::finalize(priority p,
+                                                 std::string_view str) {
+  auto number = _next.fetch_add(1, std::memory_order_relaxed);
+  auto &current = _slots[number & _mask];
+  // Mark the slot as being rewritten so a dump skips it
+  current.sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  auto length = std::min(str.size(), slot_size);
+  std::memcpy(current.data, str.data(), length);
+  if (length < str.size()) {
+    current.data[slot_size - 1] = '\n';
+  }
+  current.length = static_cast<U16>(length);
+  current.sequence.store(number + 1, std::memory_order_release);
+
+  if (static_cast<U8>(p) <= static_cast<U8>(priority::error)) {
+    dump();
+  }
+}
+
+void console::flight_recorder_listener::dump() {
+  // Someone else is dumping, what we'd write is theirs to write
+  if (_dumping.test_and_set(std::memory_order_acquire)) {
+    return;
+  }
+  auto end = _next.load(std::memory_order_acquire);
+  auto capacity = _mask + 1;
+  auto begin = std::max(_dumped.load(std::memory_order_relaxed),
+                        end > capacity ? end - capacity : U64{0});
+  if (begin < end) {
+    static constexpr char header[] = "--- flight recorder dump ---\n";
+    // Nothing we can do about a failed write here, we might be crashing
+    auto written = ::write(_descriptor, header, sizeof(header) - 1);
+    char copy[slot_size];
+    for (auto number = begin; number < end; number++) {
+      auto &current = _slots[number & _mask];
+      if (current.sequence.load(std::memory_order_acquire) != number + 1) {
+        continue;
+      }
+      // Copy first, then check nobody started rewriting the slot meanwhile
+      auto length = std::min(static_cast<std::size_t>(current.length),
+                             slot_size);
+      std::memcpy(copy, current.data, length);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (current.sequence.load(std::memory_order_relaxed) == number + 1) {
+        written = ::write(_descriptor, copy, length);
+      }
+    }
+    (void)written;
+    _dumped.store(end, std::memory_order_relaxed);
+  }
+  _dumping.clear(std::memory_order_release);
+}
+
+void console::flight_recorder_listener::flush() { dump(); }
+
+console::flight_recorder_listener::~flight_recorder_listener() {
+  auto self = this;
+  if (crash_recorder.compare_exchange_strong(self, nullptr)) {
+    for (auto signal_number : fatal_signals) {
+      std::signal(signal_number, SIG_DFL);
+    }
+  }
+  ::close(_descriptor);
+}
+
+// Interned string literals for binary logs, IDs are indices into the vector
+static auto literals_mutex = std::mutex{};
+static auto interned_literals = std::vector<std::string_view>{};
+static auto literals_count = std::atomic<U32>{0};
+
+U32 console::intern(const char *literal /**< [in] the literal's address */,
+                    std::size_t length /**< [in] the literal's length */) {
+  auto lock = std::lock_guard<std::mutex>{literals_mutex};
+  auto id = static_cast<U32>(interned_literals.size());
+  interned_literals.emplace_back(literal, length);
+  literals_count.store(id + 1, std::memory_order_release);
+  return id;
+}
+
+U32 console::interned_count() {
+  return literals_count.load(std::memory_order_acquire);
+}
+
+std::string_view console::interned(U32 id /**< [in] the literal's ID */) {
+  auto lock = std::lock_guard<std::mutex>{literals_mutex};
+  return interned_literals.at(id);
+}
+
+console::binary_file_listener::binary_file_listener(
     std::filesystem::path
         &&file_path /**< [in] the path to the log file to write */)
-    : _file{std::fopen(file_path.string().c_str(), "w")} {
+    : _file{std::fopen(file_path.string().c_str(), "wb")} {
   if (_file == nullptr) {
     throw std::runtime_error{"Couldn't open log file for write."};
   }
+  std::fwrite(format::magic, sizeof(char), sizeof(format::magic), _file);
 }
 
-void console::file_listener::prelude(
-    std::string &str /**< [in] string to log */,
-    console::priority p /**< [in] the severity of the line to output */) {
-  str += common_prelude(p);
+void console::binary_file_listener::finalize_record(const record &current) {
+  auto lock = std::lock_guard<std::mutex>{_mutex};
+  // Define every literal this file hasn't seen before the record uses it
+  for (auto count = interned_count(); _defined < count; _defined++) {
+    auto literal = interned(_defined);
+    auto length = static_cast<U16>(literal.size());
+    std::fputc(static_cast<U8>(format::entry::literal), _file);
+    std::fwrite(&_defined, sizeof(U32), 1, _file);
+    std::fwrite(&length, sizeof(U16), 1, _file);
+    std::fwrite(literal.data(), sizeof(char), length, _file);
+  }
+  auto level = static_cast<U8>(current.level);
+  auto length = static_cast<U16>(current.size());
+  std::fputc(static_cast<U8>(format::entry::record), _file);
+  std::fwrite(&current.timestamp, sizeof(U64), 1, _file);
+  std::fwrite(&level, sizeof(U8), 1, _file);
+  std::fwrite(&length, sizeof(U16), 1, _file);
+  std::fwrite(current.data(), sizeof(U8), length, _file);
 }
 
-void console::file_listener::finalize(std::string &str) {
-  std::fprintf(_file, "%s", str.c_str());
+void console::binary_file_listener::flush() {
+  auto lock = std::lock_guard<std::mutex>{_mutex};
+  std::fflush(_file);
 }
 
-console::file_listener::~file_listener() { std::fclose(_file); }
+console::binary_file_listener::~binary_file_listener() { std::fclose(_file); }
+
+/// Bytes the writer thread gathers before it has to call `fwrite`
+static constexpr auto batch_size = std::size_t{65536};
+
+console::async_file_listener::async_file_listener(
+    std::filesystem::path
+        &&file_path /**< [in] the path to the log file to write */,
+    overflow_policy policy /**< [in] what to do when the ring buffer fills */,
+    U32 slots /**< [in] ring buffer slots, rounded up to a power of two */)
+    : _file{std::fopen(file_path.string().c_str(), "w")}, _policy{policy} {
+  if (_file == nullptr) {
+    throw std::runtime_error{"Couldn't open log file for write."};
+  }
+  // We batch ourselves, stdio buffering would only copy everything twice
+  std::setvbuf(_file, nullptr, _IONBF, 0);
+
+  auto capacity = U64{1};
+  while (capacity < slots) {
+    capacity <<= 1;
+  }
+  _mask = capacity - 1;
+  _slots = std::make_unique<slot[]>(capacity);
+  for (auto i = U64{0}; i < capacity; i++) {
+    _slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  _batch = std::make_unique<char[]>(batch_size);
+
+  _writer = std::thread{[this]() {
+    while (true) {
+      // Look at the doorbell first, so a ring after this wakes the wait up
+      auto rung = _doorbell.load(std::memory_order_acquire);
+      if (!_running.load(std::memory_order_acquire)) {
+        break;
+      }
+      if (!drain()) {
+        _doorbell.wait(rung, std::memory_order_acquire);
+      }
+    }
+    // Whatever got in before we were told to stop still has to go out
+    while (drain()) {
+    }
+  }};
+}
+
+/// Wake the writer up, after publishing slots or telling it to stop
+void console::async_file_listener::ring() {
+  _doorbell.fetch_add(1, std::memory_order_release);
+  _doorbell.notify_one();
+}
+
+/// Try to claim `count` consecutive slots, returns false when they're taken
+bool console::async_file_listener::claim(U64 &position, U64 count) {
+  position = _enqueue_position.load(std::memory_order_relaxed);
+  while (true) {
+    // The writer frees slots in order, so if the last slot we want is free
+    // then every slot before it is free too.
+    auto &last = _slots[(position + count - 1) & _mask];
+    auto sequence = last.sequence.load(std::memory_order_acquire);
+    auto difference = static_cast<S64>(sequence - (position + count - 1));
+    if (difference == 0) {
+      if (_enqueue_position.compare_exchange_weak(position, position + count,
+                                                  std::memory_order_relaxed)) {
+        return true;
+      }
+    } else if (difference < 0) {
+      return false;
+    } else {
+      position = _enqueue_position.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+/// Write out every published slot, returns false if there was nothing to do
+bool console::async_file_listener::drain() {
+  auto position = _dequeue_position.load(std::memory_order_relaxed);
+  auto used = std::size_t{0};
+  auto lost = _lost.exchange(0, std::memory_order_relaxed);
+  if (lost > 0) {
+    auto notice = line{};
+    notice.append(prelude{priority::warning}.view());
+    stringify(notice, "Lost ");
+    stringify(notice, lost);
+    stringify(notice, " log records to ring buffer overflow.\n");
+    std::memcpy(_batch.get(), notice.view().data(), notice.view().size());
+    used += notice.view().size();
+  }
+
+  while (true) {
+    auto &current = _slots[position & _mask];
+    if (current.sequence.load(std::memory_order_acquire) != position + 1) {
+      break;
+    }
+    if (used + current.length > batch_size) {
+      std::fwrite(_batch.get(), sizeof(char), used, _file);
+      used = 0;
+    }
+    std::memcpy(_batch.get() + used, current.data, current.length);
+    used += current.length;
+    current.sequence.store(position + _mask + 1, std::memory_order_release);
+    position++;
+  }
+  _dequeue_position.store(position, std::memory_order_relaxed);
+
+  if (used == 0) {
+    return false;
+  }
+  std::fwrite(_batch.get(), sizeof(char), used, _file);
+  _written.store(position, std::memory_order_release);
+  _written.notify_all();
+  return true;
+}
+
+void console::async_file_listener::finalize(priority p,
+                                            std::string_view str) {
+  if (str.empty()) {
+    return;
+  }
+  auto capacity = _mask + 1;
+  auto count =
+      std::min<U64>((str.size() + slot_size - 1) / slot_size, capacity);
+  auto position = U64{0};
+  while (!claim(position, count)) {
+    switch (_policy) {
+    case overflow_policy::drop: {
+      return;
+    }
+    case overflow_policy::count: {
+      _lost.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    case overflow_policy::block: {
+      std::this_thread::yield();
+      break;
+    }
+    }
+  }
+
+  auto offset = std::size_t{0};
+  for (auto i = U64{0}; i < count; i++) {
+    auto &current = _slots[(position + i) & _mask];
+    auto length = std::min(slot_size, str.size() - offset);
+    std::memcpy(current.data, str.data() + offset, length);
+    current.length = static_cast<U16>(length);
+    offset += length;
+    current.sequence.store(position + i + 1, std::memory_order_release);
+  }
+  ring();
+}
+
+void console::async_file_listener::flush() {
+  auto target = _enqueue_position.load(std::memory_order_acquire);
+  for (auto written = _written.load(std::memory_order_acquire);
+       written < target; written = _written.load(std::memory_order_acquire)) {
+    _written.wait(written, std::memory_order_acquire);
+  }
+}
+
+console::async_file_listener::~async_file_listener() {
+  _running.store(false, std::memory_order_release);
+  ring();
+  _writer.join();
+  std::fclose(_file);
+}
 
 void console::init() {
   all_listeners = std::make_unique<console::listeners_t>();
 }
 console::listeners_t *const console::listeners() { return all_listeners.get(); }
+void console::flush() {
+  if (all_listeners == nullptr) {
+    return;
+  }
+  for (auto &&listener : *all_listeners) {
+    listener->flush();
+  }
+}
 void console::deinit() { all_listeners = nullptr; }
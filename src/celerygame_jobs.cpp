@@ -0,0 +1,161 @@
+// Celerygame work-stealing job system
+//
+// Copyright 2021 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "../include/celerygame_jobs.hpp"
+#include "../include/celerygame_console.hpp"
+using namespace celerygame;
+
+/// Tries a worker makes to find a job before going to sleep
+static constexpr auto spins_before_sleep = U32{64};
+/// Which deque a thread owns, set for the main thread and the workers only
+static constexpr auto not_a_job_thread =
+    std::numeric_limits<std::size_t>::max();
+
+using deque_t = jobs::deque<jobs::deque_capacity>;
+
+// Deque 0 belongs to the main thread, the rest to one worker each
+static auto deques = std::vector<std::unique_ptr<deque_t>>{};
+static auto threads = std::vector<std::thread>{};
+static thread_local auto this_deque = not_a_job_thread;
+
+// Jobs only the main thread may run
+static auto main_jobs_mutex = std::mutex{};
+static auto main_jobs = std::vector<jobs::job *>{};
+
+// Sleeping workers are woken when jobs are pushed to a deque
+static auto sleep_mutex = std::mutex{};
+static auto sleep_condition = std::condition_variable{};
+static auto available = std::atomic<S64>{0};
+static auto sleeping = std::atomic<U32>{0};
+static auto quitting = std::atomic<bool>{false};
+
+/// Run a job taken from a deque
+static void run(jobs::job *j) {
+  available.fetch_sub(1);
+  j->function(j->context);
+}
+
+/// Find a job, the thread's own deque first, then steal from the others
+static jobs::job *find_job(std::size_t index) {
+  if (auto j = deques[index]->take(); j != nullptr) {
+    return j;
+  }
+  for (auto i = std::size_t{1}; i < deques.size(); i++) {
+    auto victim = (index + i) % deques.size();
+    if (auto j = deques[victim]->steal(); j != nullptr) {
+      return j;
+    }
+  }
+  return nullptr;
+}
+
+/// What each worker thread runs until `deinit`
+static void work(std::size_t index) {
+  this_deque = index;
+  auto spins = U32{0};
+  while (!quitting.load(std::memory_order_acquire)) {
+    if (auto j = find_job(index); j != nullptr) {
+      run(j);
+      spins = 0;
+    } else if (spins++ < spins_before_sleep) {
+      std::this_thread::yield();
+    } else {
+      auto lock = std::unique_lock<std::mutex>{sleep_mutex};
+      sleeping.fetch_add(1);
+      sleep_condition.wait(
+          lock, [] { return available.load() > 0 || quitting.load(); });
+      sleeping.fetch_sub(1);
+      spins = 0;
+    }
+  }
+}
+
+void jobs::init(std::size_t count /**< [in] worker threads, 0 for auto */) {
+  if (!deques.empty()) {
+    throw std::runtime_error{"The job system is already initialized."};
+  }
+  if (count == 0) {
+    auto hardware = std::thread::hardware_concurrency();
+    count = hardware > 1 ? hardware - 1 : 0;
+  }
+  console::log(console::priority::notice, "Starting "_literal, count,
+               " job workers.\n"_literal);
+  quitting.store(false);
+  this_deque = 0;
+  for (auto i = std::size_t{0}; i <= count; i++) {
+    deques.emplace_back(std::make_unique<deque_t>());
+  }
+  for (auto i = std::size_t{1}; i <= count; i++) {
+    threads.emplace_back(work, i);
+  }
+}
+
+std::size_t jobs::workers() { return threads.size(); }
+
+void jobs::push(job *j /**< [in] the job, must outlive running it */) {
+  if (this_deque == not_a_job_thread) {
+    throw std::runtime_error{
+        "Jobs can only be pushed from the main thread or a job worker."};
+  }
+  if (!deques[this_deque]->push(j)) {
+    // Our deque is full, running it now is as good as any other thread
+    j->function(j->context);
+    return;
+  }
+  available.fetch_add(1);
+  if (sleeping.load() > 0) {
+    auto lock = std::lock_guard<std::mutex>{sleep_mutex};
+    sleep_condition.notify_one();
+  }
+}
+
+void jobs::push_main(job *j /**< [in] the job, must outlive running it */) {
+  auto lock = std::lock_guard<std::mutex>{main_jobs_mutex};
+  main_jobs.emplace_back(j);
+}
+
+bool jobs::run_one() {
+  auto main_job = static_cast<job *>(nullptr);
+  {
+    auto lock = std::lock_guard<std::mutex>{main_jobs_mutex};
+    if (!main_jobs.empty()) {
+      main_job = main_jobs.back();
+      main_jobs.pop_back();
+    }
+  }
+  if (main_job != nullptr) {
+    main_job->function(main_job->context);
+    return true;
+  }
+  if (auto j = find_job(0); j != nullptr) {
+    run(j);
+    return true;
+  }
+  return false;
+}
+
+void jobs::deinit() {
+  {
+    auto lock = std::lock_guard<std::mutex>{sleep_mutex};
+    quitting.store(true);
+    sleep_condition.notify_all();
+  }
+  for (auto &&thread : threads) {
+    thread.join();
+  }
+  threads.clear();
+  deques.clear();
+  console::log(console::priority::notice, "Stopped job workers.\n"_literal);
+}
@@ -0,0 +1,148 @@
+// Celerygame console line formatting benchmark
+//
+// Copyright 2021 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "../include/celerygame_console.hpp"
+using namespace celerygame;
+
+/// Listeners this benchmarks formatting for, like a terminal and a file
+static constexpr auto listener_count = std::size_t{2};
+
+/// Keeps the compiler from optimizing the formatted lines away
+static auto checksum = std::size_t{0};
+
+/// A listener that drops every line
+class null_listener : public console::listener {
+public:
+  void finalize(console::priority, std::string_view str) override {
+    checksum += str.size();
+  }
+};
+
+/// The prelude as it was, formatted through a stringstream per listener
+static std::string common_prelude(console::priority p) {
+  auto formatter = std::stringstream{};
+  formatter << "[";
+  auto now = std::chrono::system_clock::now();
+  auto now_ti = std::chrono::system_clock::to_time_t(now);
+  char now_buf[64]{0x00};
+  std::strftime(now_buf, sizeof(char) * 63, "%T", std::localtime(&now_ti));
+  auto milli = std::chrono::duration_cast<std::chrono::milliseconds>(
+                   now.time_since_epoch())
+                   .count() %
+               1000;
+  formatter << now_buf;
+  formatter << ".";
+  formatter << std::setw(3) << std::setfill('0') << milli;
+  formatter << std::setw(0) << std::setfill(' ') << "] ";
+  switch (p) {
+  case console::priority::emergency: {
+    formatter << "[ EMG ] ";
+    break;
+  }
+  case console::priority::alert: {
+    formatter << "[ ALT ] ";
+    break;
+  }
+  case console::priority::critical: {
+    formatter << "[ CRT ] ";
+    break;
+  }
+  case console::priority::error: {
+    formatter << "[ ERR ] ";
+    break;
+  }
+  case console::priority::warning: {
+    formatter << "[ WRN ] ";
+    break;
+  }
+  case console::priority::notice: {
+    formatter << "[ NOT ] ";
+    break;
+  }
+  case console::priority::informational: {
+    formatter << "[ INF ] ";
+    break;
+  }
+  case console::priority::debug: {
+    formatter << "[ DBG ] ";
+    break;
+  }
+  }
+  return formatter.str();
+}
+
+/// Append a number the way `line::append_number` does, so only the prelude
+/// and the per-listener copies differ between the two paths
+template <class T> static void append_number(std::string &str, T number) {
+  char buf[32];
+  auto result = std::to_chars(buf, buf + sizeof(buf), number);
+  str.append(buf, static_cast<std::size_t>(result.ptr - buf));
+}
+
+/// A line as it was logged, every listener formatting its own copy
+static void old_log(U32 frame) {
+  for (auto i = std::size_t{0}; i < listener_count; i++) {
+    auto str = common_prelude(console::priority::debug);
+    str += "frame ";
+    append_number(str, frame);
+    str += " took ";
+    append_number(str, 0.016);
+    str += "\n";
+    checksum += str.size();
+  }
+}
+
+/// A line as it's logged now, formatted once on the stack
+static void new_log(U32 frame) {
+  console::log(console::priority::debug, "frame ", frame, " took ", 0.016,
+               "\n");
+}
+
+/// Time logging `lines` lines, returns lines per second
+template <class F> static F64 measure(F &&log_line, U32 lines) {
+  auto begin = std::chrono::steady_clock::now();
+  for (auto i = U32{0}; i < lines; i++) {
+    log_line(i);
+  }
+  auto seconds = std::chrono::duration<F64>{std::chrono::steady_clock::now() -
+                                            begin}
+                     .count();
+  return lines / seconds;
+}
+
+int main(int argc, char **argv) {
+  auto lines = U32{1000000};
+  if (argc > 2) {
+    std::fprintf(stderr, "Usage: %s [lines]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (argc == 2) {
+    lines = static_cast<U32>(std::strtoul(argv[1], nullptr, 10));
+  }
+
+  console::init();
+  for (auto i = std::size_t{0}; i < listener_count; i++) {
+    console::listeners()->emplace_back(new null_listener{});
+  }
+  auto old_rate = measure(old_log, lines);
+  auto new_rate = measure(new_log, lines);
+  console::deinit();
+
+  std::printf("%u debug lines, %zu null listeners\n", lines, listener_count);
+  std::printf("stringstream prelude: %12.0f lines/s\n", old_rate);
+  std::printf("cached prelude:       %12.0f lines/s\n", new_rate);
+  std::printf("(checksum %zu)\n", checksum);
+  return EXIT_SUCCESS;
+}
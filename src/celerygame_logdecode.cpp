@@ -0,0 +1,269 @@
+// Celerygame binary console log decoder
+//
+// Copyright 2021 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "../include/celerygame_console_format.hpp"
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <vector>
+using namespace celerygame::console;
+
+/// Reads host byte order values out of a byte range
+class reader {
+  const char *_current;
+  const char *_end;
+
+public:
+  reader(const char *begin, const char *end) : _current{begin}, _end{end} {}
+
+  /// Is there anything left to read?
+  bool empty() const { return _current >= _end; }
+
+  /// Where the next read starts
+  const char *position() const { return _current; }
+
+  /// Read a value, returns false if there aren't enough bytes left
+  template <class T> bool read(T &value) {
+    if (static_cast<std::size_t>(_end - _current) < sizeof(T)) {
+      _current = _end;
+      return false;
+    }
+    std::memcpy(&value, _current, sizeof(T));
+    _current += sizeof(T);
+    return true;
+  }
+
+  /// Read some bytes, returns false if there aren't enough bytes left
+  bool read(std::string_view &view, std::size_t size) {
+    if (static_cast<std::size_t>(_end - _current) < size) {
+      _current = _end;
+      return false;
+    }
+    view = std::string_view{_current, size};
+    _current += size;
+    return true;
+  }
+};
+
+/// Append a number the same way the engine's `stringify` does
+template <class T> static void append_number(std::string &out, T number) {
+  char buf[32];
+  auto result = std::to_chars(buf, buf + sizeof(buf), number);
+  out.append(buf, result.ptr - buf);
+}
+
+/// Decode one tagged argument, returns false on a truncated payload
+static bool decode_argument(reader &payload, std::string &out,
+                            const std::vector<std::string> &literals) {
+  auto tag = format::tag{};
+  if (!payload.read(tag)) {
+    return false;
+  }
+  switch (tag) {
+  case format::tag::literal: {
+    auto id = std::uint32_t{0};
+    if (!payload.read(id)) {
+      return false;
+    }
+    out += id < literals.size() ? literals[id] : std::string{"(?)"};
+    return true;
+  }
+  case format::tag::string: {
+    auto length = std::uint16_t{0};
+    auto str = std::string_view{};
+    if (!payload.read(length) || !payload.read(str, length)) {
+      return false;
+    }
+    out += str;
+    return true;
+  }
+  case format::tag::boolean: {
+    auto value = std::uint8_t{0};
+    if (!payload.read(value)) {
+      return false;
+    }
+    out += value ? "true" : "false";
+    return true;
+  }
+  case format::tag::character: {
+    auto value = char{0};
+    if (!payload.read(value)) {
+      return false;
+    }
+    out += value;
+    return true;
+  }
+#define DECODE_NUMBER(TAG, TYPE)                                               \
+  case format::tag::TAG: {                                                     \
+    auto value = TYPE{0};                                                      \
+    if (!payload.read(value)) {                                                \
+      return false;                                                            \
+    }                                                                          \
+    append_number(out, value);                                                 \
+    return true;                                                               \
+  }
+    DECODE_NUMBER(u8, std::uint8_t)
+    DECODE_NUMBER(u16, std::uint16_t)
+    DECODE_NUMBER(u32, std::uint32_t)
+    DECODE_NUMBER(u64, std::uint64_t)
+    DECODE_NUMBER(s8, std::int8_t)
+    DECODE_NUMBER(s16, std::int16_t)
+    DECODE_NUMBER(s32, std::int32_t)
+    DECODE_NUMBER(s64, std::int64_t)
+    DECODE_NUMBER(f32, float)
+    DECODE_NUMBER(f64, double)
+#undef DECODE_NUMBER
+  case format::tag::vec:
+  case format::tag::mat: {
+    auto length = std::uint8_t{0};
+    if (!payload.read(length)) {
+      return false;
+    }
+    out += tag == format::tag::vec ? '(' : '[';
+    for (auto i = std::uint8_t{0}; i < length; i++) {
+      if (i > 0) {
+        out += ", ";
+      }
+      if (!decode_argument(payload, out, literals)) {
+        return false;
+      }
+    }
+    out += tag == format::tag::vec ? ')' : ']';
+    return true;
+  }
+  }
+  return false;
+}
+
+/// Format a record's prelude the same way the engine's `prelude` does
+static void decode_prelude(std::string &out, std::uint64_t timestamp,
+                           std::uint8_t priority) {
+  auto seconds = static_cast<std::time_t>(timestamp / 1000000);
+  auto milli = static_cast<unsigned>(timestamp / 1000 % 1000);
+  auto seconds_tm = std::tm{};
+#ifdef _WIN32
+  localtime_s(&seconds_tm, &seconds);
+#else
+  localtime_r(&seconds, &seconds_tm);
+#endif
+  char buf[32];
+  std::strftime(buf, sizeof(buf), "%T", &seconds_tm);
+  out += '[';
+  out += buf;
+  out += '.';
+  out += static_cast<char>('0' + milli / 100);
+  out += static_cast<char>('0' + milli / 10 % 10);
+  out += static_cast<char>('0' + milli % 10);
+  out += "] ";
+  out += format::priority_tags[format::priority_index(priority) % 8];
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    std::fprintf(stderr, "usage: %s <binary log> [text log]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  auto in = std::fopen(argv[1], "rb");
+  if (in == nullptr) {
+    std::fprintf(stderr, "Couldn't open '%s' for read.\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  auto bytes = std::vector<char>{};
+  char buf[65536];
+  for (auto got = std::fread(buf, 1, sizeof(buf), in); got > 0;
+       got = std::fread(buf, 1, sizeof(buf), in)) {
+    bytes.insert(bytes.end(), buf, buf + got);
+  }
+  std::fclose(in);
+
+  if (bytes.size() < sizeof(format::magic) ||
+      std::memcmp(bytes.data(), format::magic, sizeof(format::magic)) != 0) {
+    std::fprintf(stderr, "'%s' isn't a binary console log this version.\n",
+                 argv[1]);
+    return EXIT_FAILURE;
+  }
+  auto out = argc == 3 ? std::fopen(argv[2], "w") : stdout;
+  if (out == nullptr) {
+    std::fprintf(stderr, "Couldn't open '%s' for write.\n", argv[2]);
+    return EXIT_FAILURE;
+  }
+
+  auto stream = reader{bytes.data() + sizeof(format::magic),
+                       bytes.data() + bytes.size()};
+  auto literals = std::vector<std::string>{};
+  auto text = std::string{};
+  auto status = EXIT_SUCCESS;
+  // Where the entry being decoded starts, reported if it's bad
+  auto offset = std::size_t{0};
+  while (!stream.empty()) {
+    offset = static_cast<std::size_t>(stream.position() - bytes.data());
+    auto kind = format::entry{};
+    stream.read(kind);
+    if (kind == format::entry::literal) {
+      auto id = std::uint32_t{0};
+      auto length = std::uint16_t{0};
+      auto literal = std::string_view{};
+      if (!stream.read(id) || !stream.read(length) ||
+          !stream.read(literal, length)) {
+        std::fprintf(stderr, "Truncated literal at offset %zu.\n", offset);
+        status = EXIT_FAILURE;
+        break;
+      }
+      // Each file defines its literals in order, once each
+      if (id != literals.size()) {
+        std::fprintf(stderr,
+                     "Literal %u at offset %zu should be %zu, the log is "
+                     "corrupt.\n",
+                     static_cast<unsigned>(id), offset, literals.size());
+        status = EXIT_FAILURE;
+        break;
+      }
+      literals.emplace_back(literal);
+    } else if (kind == format::entry::record) {
+      auto timestamp = std::uint64_t{0};
+      auto priority = std::uint8_t{0};
+      auto length = std::uint16_t{0};
+      auto payload_bytes = std::string_view{};
+      if (!stream.read(timestamp) || !stream.read(priority) ||
+          !stream.read(length) || !stream.read(payload_bytes, length)) {
+        std::fprintf(stderr, "Truncated record at offset %zu.\n", offset);
+        status = EXIT_FAILURE;
+        break;
+      }
+      text.clear();
+      decode_prelude(text, timestamp, priority);
+      auto payload = reader{payload_bytes.data(),
+                            payload_bytes.data() + payload_bytes.size()};
+      while (!payload.empty() && decode_argument(payload, text, literals)) {
+      }
+      std::fwrite(text.data(), sizeof(char), text.size(), out);
+    } else {
+      std::fprintf(stderr,
+                   "Unknown entry kind at offset %zu, the log is corrupt.\n",
+                   offset);
+      status = EXIT_FAILURE;
+      break;
+    }
+  }
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+  return status;
+}
@@ -15,6 +15,9 @@
 // limitations under the License.
 #include "../include/celerygame_lua.hpp"
 #include "../include/celerygame_console.hpp"
+#include "../include/celerygame_lua_bind.hpp"
+#include "../include/celerygame_lua_worker.hpp"
+#include "../include/celerygame_profiler.hpp"
 #include "../include/celerygame_vulkan_instance.hpp"
 #include "../include/celerygame_vulkan_utils.hpp"
 #include "../include/celerygame_vulkan_window.hpp"
@@ -22,121 +25,1344 @@ using namespace celerygame;
 
 static lua_State *L = nullptr;
 
+// Callbacks are resolved into registry references once, calling them doesn't
+// look anything up
+static auto error_handler = LUA_NOREF;
+static auto init_callback = LUA_NOREF;
+static auto runloop_callback = LUA_NOREF;
+static auto deinit_callback = LUA_NOREF;
+
+/// Tasks added from Lua, by their function's registry reference
+static auto lua_tasks = std::unordered_map<int, runloop::handle>{};
+
+/// A timer calling a Lua function, kept by the function's registry reference
+struct lua_timer {
+  runloop::timer timer;
+  bool periodic;
+};
+static auto lua_timers = std::unordered_map<int, lua_timer>{};
+
+// =============================================================================
+// Lua memory
+// =============================================================================
+
+// Most Lua objects are small and short lived, so blocks up to 512 bytes come
+// from size-class pools carved out of chunks, like coroutine frames do
+static constexpr auto block_granularity = std::size_t{16};
+static constexpr auto block_classes = std::size_t{32};
+static constexpr auto block_chunk = std::size_t{64 * 1024};
+static auto block_free = std::array<void *, block_classes>{};
+static auto block_chunks = std::vector<std::unique_ptr<std::byte[]>>{};
+/// Did the state take our allocator? LuaJIT only does on some targets.
+static auto engine_allocator = false;
+
+static auto current_collector = lua::collector{};
+static auto current_memory = lua::memory_stats{};
+/// Bytes in use when the collector last finished a cycle
+static auto collected_live = std::size_t{0};
+static auto collector_task = runloop::handle{};
+/// Scripted tasks alive, the collector leaves the run loop after the last
+static auto scripted_tasks = std::size_t{0};
+
+/// Subsystems charged for allocations, and which one's running the state
+static auto memory_accounts =
+    std::vector<lua::account_stats>{{"engine", 0, 0}};
+static auto charged = std::size_t{0};
+
+/// Charges the state's allocations to a subsystem while in scope
+class charge_to {
+  std::size_t _previous;
+
+public:
+  explicit charge_to(const char *name) : _previous{charged} {
+    for (charged = 0; charged < memory_accounts.size(); charged++) {
+      if (std::string_view{memory_accounts[charged].name} == name) {
+        return;
+      }
+    }
+    memory_accounts.emplace_back(lua::account_stats{name, 0, 0});
+  }
+  ~charge_to() { charged = _previous; }
+};
+
+static std::size_t block_class(std::size_t size) {
+  return (size + block_granularity - 1) / block_granularity;
+}
+
+static bool pooled(std::size_t size_class) {
+  return size_class > 0 && size_class <= block_classes;
+}
+
+static void *allocate_block(std::size_t size) {
+  auto size_class = block_class(size);
+  if (!pooled(size_class)) {
+    return std::malloc(size);
+  }
+  auto &head = block_free[size_class - 1];
+  if (head == nullptr) {
+    // Running out of memory has to reach Lua as nullptr, not an exception
+    try {
+      auto block = size_class * block_granularity;
+      auto &chunk = block_chunks.emplace_back(
+          std::make_unique<std::byte[]>(block_chunk));
+      current_memory.pooled += block_chunk;
+      for (auto offset = block_chunk / block * block; offset > 0;
+           offset -= block) {
+        auto fresh = chunk.get() + offset - block;
+        *reinterpret_cast<void **>(fresh) = head;
+        head = fresh;
+      }
+    } catch (const std::bad_alloc &) {
+      return nullptr;
+    }
+  }
+  auto block = head;
+  head = *static_cast<void **>(block);
+  return block;
+}
+
+static void free_block(void *block, std::size_t size) {
+  auto size_class = block_class(size);
+  if (!pooled(size_class)) {
+    std::free(block);
+    return;
+  }
+  *static_cast<void **>(block) = block_free[size_class - 1];
+  block_free[size_class - 1] = block;
+}
+
+/// The state's `lua_Alloc`, Lua always tells us a block's size
+static void *allocate(void *, void *block, std::size_t old_size,
+                      std::size_t new_size) {
+  if (block == nullptr) {
+    old_size = 0;
+  }
+  if (new_size == 0) {
+    if (block != nullptr) {
+      free_block(block, old_size);
+      current_memory.live -= old_size;
+    }
+    return nullptr;
+  }
+
+  auto old_class = block_class(old_size);
+  auto new_class = block_class(new_size);
+  auto moved = static_cast<void *>(nullptr);
+  if (block != nullptr && old_class == new_class && pooled(new_class)) {
+    moved = block;
+  } else if (block != nullptr && !pooled(old_class) && !pooled(new_class)) {
+    moved = std::realloc(block, new_size);
+  } else {
+    moved = allocate_block(new_size);
+    if (moved != nullptr && block != nullptr) {
+      std::memcpy(moved, block, std::min(old_size, new_size));
+      free_block(block, old_size);
+    }
+  }
+  // Failing leaves the old block alone, Lua raises a memory error
+  if (moved == nullptr) {
+    return nullptr;
+  }
+
+  current_memory.live = current_memory.live - old_size + new_size;
+  current_memory.peak = std::max(current_memory.peak, current_memory.live);
+  if (new_size > old_size) {
+    auto &account = memory_accounts[charged];
+    account.allocations++;
+    account.bytes += new_size - old_size;
+  }
+  return moved;
+}
+
+/// Bytes the state has in use, as the collector counts them
+static std::size_t in_use() {
+  return static_cast<std::size_t>(lua_gc(L, LUA_GCCOUNT, 0)) * 1024 +
+         static_cast<std::size_t>(lua_gc(L, LUA_GCCOUNTB, 0));
+}
+
+/// Steps the collector in what's left of the frame, the only place it runs
+/// unless it falls behind
+static bool collect_garbage(void *, const runloop::frame &) {
+  // Housekeeping mustn't keep the run loop going once the scripts quit
+  if (L == nullptr || scripted_tasks == 0) {
+    return true;
+  }
+  auto scope = profiler::zone{"lua::collect_garbage"};
+  auto start = std::chrono::steady_clock::now();
+  auto budget = std::chrono::duration<F64>{
+      std::min(current_collector.budget, runloop::slack())};
+  auto step = std::max(current_collector.step, 1);
+  // Always step once, or garbage would pile up while frames run late
+  do {
+    current_memory.steps++;
+    if (lua_gc(L, LUA_GCSTEP, step) != 0) {
+      current_memory.cycles++;
+      collected_live = in_use();
+      break;
+    }
+  } while (std::chrono::steady_clock::now() - start < budget);
+  current_memory.collecting +=
+      std::chrono::duration<F64>{std::chrono::steady_clock::now() - start}
+          .count();
+
+  // Stepping restarts the collector, so stop it again unless frame ends
+  // aren't enough to keep up
+  if (in_use() > std::max(current_collector.floor, 2 * collected_live)) {
+    current_memory.backlogs++;
+    lua_gc(L, LUA_GCRESTART, 0);
+  } else {
+    lua_gc(L, LUA_GCSTOP, 0);
+  }
+  return false;
+}
+
+void lua::set_collector(const collector &to /**< [in] the new settings */) {
+  current_collector = to;
+}
+
+const lua::collector &lua::get_collector() { return current_collector; }
+
+lua::memory_stats lua::memory() {
+  auto stats = current_memory;
+  if (!engine_allocator && L != nullptr) {
+    stats.live = in_use();
+  }
+  return stats;
+}
+
+std::vector<lua::account_stats> lua::accounts() { return memory_accounts; }
+
+// =============================================================================
+// Bytecode cache
+// =============================================================================
+
+/// Where compiled scripts are kept, empty to always compile
+static auto cache_directory = std::filesystem::path{};
+/// Where `require` finds modules, the init file's directory
+static auto script_root = std::filesystem::path{};
+static auto cache_hits = U64{0};
+static auto cache_misses = U64{0};
+
+/// Starts every cache file, the bytecode follows
+struct cache_header {
+  char magic[4]; ///< "CGB2", older layouts are compiled again
+  U32 version;   ///< The LuaJIT that compiled it
+  S64 modified;  ///< The source's modification time, a hint only
+  U64 size;      ///< Bytes in the source
+  U64 hash;      ///< FNV-1a of the source
+};
+static constexpr char cache_magic[4] = {'C', 'G', 'B', '2'};
+
+/// LuaJIT bytecode starts with this, precompiled scripts aren't cached again
+static constexpr auto bytecode_signature = std::string_view{"\x1bLJ"};
+
+static U64 fnv1a(std::string_view bytes) {
+  auto hash = U64{14695981039346656037u};
+  for (auto byte : bytes) {
+    hash = (hash ^ static_cast<U8>(byte)) * U64{1099511628211u};
+  }
+  return hash;
+}
+
+/// Read a whole file, false if it can't be
+static bool read_file(const std::filesystem::path &path, std::string &into) {
+  auto file = std::fopen(path.string().c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  into.clear();
+  auto buffer = std::array<char, 4096>{};
+  auto got = std::size_t{0};
+  while ((got = std::fread(buffer.data(), sizeof(char), buffer.size(), file)) >
+         0) {
+    into.append(buffer.data(), got);
+  }
+  auto failed = std::ferror(file) != 0;
+  std::fclose(file);
+  return !failed;
+}
+
+/// A script's cache file, named after a hash of its path
+static std::filesystem::path cache_path(const std::filesystem::path &script) {
+  auto name = std::array<char, 16>{};
+  auto hash = fnv1a(script.lexically_normal().generic_string());
+  auto end = std::to_chars(name.data(), name.data() + name.size(), hash, 16);
+  return cache_directory /
+         (std::string{name.data(), end.ptr} + ".ljbc");
+}
+
+static int dump_into(lua_State *, const void *bytes, std::size_t size,
+                     void *into) {
+  static_cast<std::string *>(into)->append(static_cast<const char *>(bytes),
+                                           size);
+  return 0;
+}
+
+/// Write a cache file whole, or not at all
+static void write_cache(const std::filesystem::path &cached,
+                        const cache_header &header,
+                        std::string_view bytecode) {
+  auto error = std::error_code{};
+  std::filesystem::create_directories(cache_directory, error);
+  auto partial = cached;
+  partial += ".partial";
+  auto file = std::fopen(partial.string().c_str(), "wb");
+  if (file == nullptr) {
+    console::log(console::channel::lua, console::priority::debug,
+                 "Can't write bytecode cache file "_literal, partial.string(),
+                 "\n"_literal);
+    return;
+  }
+  auto written =
+      std::fwrite(&header, sizeof(cache_header), 1, file) == 1 &&
+      std::fwrite(bytecode.data(), sizeof(char), bytecode.size(), file) ==
+          bytecode.size();
+  written = std::fclose(file) == 0 && written;
+  if (written) {
+    std::filesystem::rename(partial, cached, error);
+  }
+  if (!written || error) {
+    std::filesystem::remove(partial, error);
+  }
+}
+
+/// Load a script as a function on top of the stack like `luaL_loadfile`,
+/// from its cached bytecode while that's fresh. The cache is fresh if the
+/// script's size and hash match, modification times can't be trusted across
+/// checkouts, copies and coarse filesystem clocks.
+static int load_script(lua_State *L0, const std::filesystem::path &script) {
+  auto error = std::error_code{};
+  auto modified = static_cast<S64>(
+      std::filesystem::last_write_time(script, error)
+          .time_since_epoch()
+          .count());
+  auto source = std::string{};
+  if (error || !read_file(script, source)) {
+    // Let Lua report the missing file
+    return luaL_loadfile(L0, script.string().c_str());
+  }
+  auto chunkname = "@" + script.generic_string();
+  if (cache_directory.empty() ||
+      std::string_view{source}.substr(0, bytecode_signature.size()) ==
+          bytecode_signature) {
+    return luaL_loadbuffer(L0, source.data(), source.size(),
+                           chunkname.c_str());
+  }
+
+  auto cached = cache_path(script);
+  auto contents = std::string{};
+  auto header = cache_header{};
+  auto hash = fnv1a(source);
+  if (read_file(cached, contents) && contents.size() > sizeof(cache_header)) {
+    std::memcpy(&header, contents.data(), sizeof(cache_header));
+    auto bytecode = std::string_view{contents}.substr(sizeof(cache_header));
+    if (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) == 0 &&
+        header.version == LUAJIT_VERSION_NUM &&
+        header.size == source.size() && header.hash == hash) {
+      if (luaL_loadbuffer(L0, bytecode.data(), bytecode.size(),
+                          chunkname.c_str()) == 0) {
+        cache_hits++;
+        return 0;
+      }
+      // Bytecode from a build this LuaJIT can't read, compile it again
+      lua_pop(L0, 1);
+    }
+  }
+
+  auto status =
+      luaL_loadbuffer(L0, source.data(), source.size(), chunkname.c_str());
+  if (status != 0) {
+    return status;
+  }
+  cache_misses++;
+  auto bytecode = std::string{};
+  if (lua_dump(L0, &dump_into, &bytecode) == 0) {
+    header = cache_header{};
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = LUAJIT_VERSION_NUM;
+    header.modified = modified;
+    header.size = source.size();
+    header.hash = hash;
+    write_cache(cached, header, bytecode);
+  }
+  return 0;
+}
+
+/// A `package.loaders` entry, finding modules under the script root and
+/// loading them through the cache
+static int cached_loader(lua_State *L0) {
+  auto status = 0;
+  {
+    auto name = std::string{luaL_checkstring(L0, 1)};
+    std::replace(name.begin(), name.end(), '.', '/');
+    auto script = script_root / (name + ".lua");
+    auto error = std::error_code{};
+    if (!std::filesystem::is_regular_file(script, error)) {
+      lua_pushfstring(L0, "\n\tno file '%s'", script.string().c_str());
+      return 1;
+    }
+    status = load_script(L0, script);
+    if (status != 0) {
+      lua_pushfstring(L0, "error loading module '%s' from file '%s':\n\t%s",
+                      lua_tostring(L0, 1), script.string().c_str(),
+                      lua_tostring(L0, -1));
+    }
+  }
+  // Raised out here, where nothing's left to destroy
+  if (status != 0) {
+    return lua_error(L0);
+  }
+  return 1;
+}
+
+// =============================================================================
+// Sampling profiler
+// =============================================================================
+
+/// Samples by stack, root first and separated by ';'
+static auto sampled_stacks = std::unordered_map<std::string, U64>{};
+/// Samples by what the VM was doing, by LuaJIT's letter for it
+static auto sampled_states = std::map<char, U64>{};
+static auto sampled_total = U64{0};
+static auto sample_file = std::filesystem::path{};
+static auto sampling = false;
+/// Functions in the report, by most samples in them
+static constexpr auto reported_functions = std::size_t{20};
+/// Deepest stack sampled
+static constexpr auto sampled_depth = 64;
+
+#if LUAJIT_VERSION_NUM >= 20100
+/// Called back by LuaJIT's profiler at the VM's next safe point
+static void take_sample(void *, lua_State *L0, int samples, int vmstate) {
+  // Running out of memory drops the sample, it can't unwind into the VM
+  try {
+    auto length = std::size_t{0};
+    auto &&stack =
+        luaJIT_profile_dumpstack(L0, "FZ;", -sampled_depth, &length);
+    sampled_stacks[std::string{stack, length}] += samples;
+    sampled_states[static_cast<char>(vmstate)] += samples;
+    sampled_total += samples;
+  } catch (const std::bad_alloc &) {
+  }
+}
+#endif
+
+/// What LuaJIT's letter for a VM state means
+static const char *vm_state_name(char state) {
+  switch (state) {
+  case 'N':
+    return "compiled";
+  case 'I':
+    return "interpreted";
+  case 'C':
+    return "C functions";
+  case 'G':
+    return "collecting garbage";
+  case 'J':
+    return "JIT compiling";
+  default:
+    return "elsewhere";
+  }
+}
+
+/// Write the samples as folded stacks, one stack and its samples per line
+static void write_samples() {
+  auto file = std::fopen(sample_file.string().c_str(), "w");
+  if (file == nullptr) {
+    console::log(console::channel::lua, console::priority::error,
+                 "Can't write Lua samples to "_literal, sample_file.string(),
+                 "\n"_literal);
+    return;
+  }
+  for (auto &&[stack, samples] : sampled_stacks) {
+    std::fprintf(file, "%s %llu\n",
+                 stack.empty() ? "(no Lua)" : stack.c_str(),
+                 static_cast<unsigned long long>(samples));
+  }
+  std::fclose(file);
+}
+
+/// Log where the samples landed, by function
+static void report_samples() {
+  console::log(console::channel::lua, console::priority::informational,
+               "Lua samples: "_literal, sampled_total, ", written to "_literal,
+               sample_file.string(), "\n"_literal);
+  if (sampled_total == 0) {
+    return;
+  }
+  for (auto &&[state, samples] : sampled_states) {
+    console::log(console::channel::lua, console::priority::informational,
+                 "  "_literal, samples * 100 / sampled_total, "% "_literal,
+                 vm_state_name(state), "\n"_literal);
+  }
+
+  struct function_samples {
+    std::string_view name;
+    U64 self;
+    U64 total;
+  };
+  auto functions = std::unordered_map<std::string_view, function_samples>{};
+  auto seen = std::vector<std::string_view>{};
+  for (auto &&[stack, samples] : sampled_stacks) {
+    seen.clear();
+    auto rest = std::string_view{stack};
+    while (!rest.empty()) {
+      auto end = rest.find(';');
+      auto name = rest.substr(0, end);
+      rest = end == std::string_view::npos ? std::string_view{}
+                                           : rest.substr(end + 1);
+      auto &function = functions.try_emplace(name, name, 0, 0).first->second;
+      // Recursion counts once towards total time
+      if (std::find(seen.begin(), seen.end(), name) == seen.end()) {
+        seen.emplace_back(name);
+        function.total += samples;
+      }
+      if (rest.empty()) {
+        function.self += samples;
+      }
+    }
+  }
+
+  auto by_self = std::vector<function_samples>{};
+  by_self.reserve(functions.size());
+  for (auto &&[name, function] : functions) {
+    by_self.emplace_back(function);
+  }
+  auto shown = std::min(by_self.size(), reported_functions);
+  std::partial_sort(by_self.begin(), by_self.begin() + shown, by_self.end(),
+                    [](const function_samples &a, const function_samples &b) {
+                      return a.self > b.self;
+                    });
+  console::log(console::channel::lua, console::priority::informational,
+               "  self% total% function\n"_literal);
+  for (auto i = std::size_t{0}; i < shown; i++) {
+    console::log(console::channel::lua, console::priority::informational,
+                 "  "_literal, by_self[i].self * 100 / sampled_total,
+                 "% "_literal, by_self[i].total * 100 / sampled_total,
+                 "% "_literal, by_self[i].name, "\n"_literal);
+  }
+}
+
+bool lua::start_sampling(U32 interval /**< [in] milliseconds per sample */,
+                         std::filesystem::path &&file /**< [in] output */) {
+#if LUAJIT_VERSION_NUM >= 20100
+  if (sampling || L == nullptr) {
+    return false;
+  }
+  sampled_stacks.clear();
+  sampled_states.clear();
+  sampled_total = 0;
+  sample_file = std::move(file);
+  // "f" samples per function and "i" sets the interval, in milliseconds
+  auto mode = "fi" + std::to_string(std::max(interval, U32{1}));
+  luaJIT_profile_start(L, mode.c_str(), &take_sample, nullptr);
+  sampling = true;
+  console::log(console::channel::lua, console::priority::informational,
+               "Sampling Lua every "_literal, interval, " ms.\n"_literal);
+  return true;
+#else
+  console::log(console::channel::lua, console::priority::warning,
+               "This LuaJIT has no profiler to sample with.\n"_literal);
+  return false;
+#endif
+}
+
+void lua::stop_sampling() {
+  if (!sampling) {
+    return;
+  }
+#if LUAJIT_VERSION_NUM >= 20100
+  luaJIT_profile_stop(L);
+#endif
+  sampling = false;
+  write_samples();
+  report_samples();
+}
+
+bool lua::is_sampling() { return sampling; }
+
+// =============================================================================
+// Trace diagnostics
+// =============================================================================
+
+/// What the trace compiler did with traces starting at a line
+struct trace_site {
+  U64 started = 0;
+  U64 stopped = 0;
+  U64 aborted = 0;
+  bool blacklisted = false;
+  std::string reason; ///< Why the last abort happened
+};
+static auto trace_sites = std::unordered_map<std::string, trace_site>{};
+/// The function attached to `jit.attach`, LUA_NOREF if not watching
+static auto trace_handler = LUA_NOREF;
+/// Sites in the trace report, by most aborts
+static constexpr auto reported_sites = std::size_t{10};
+
+/// Called from the trace handler with where a trace started
+static void trace_event(std::string_view what, int trace, std::string where,
+                        std::string_view reason, bool blacklisted) {
+  if (what == "flush") {
+    console::log(console::channel::jit, console::priority::informational,
+                 "Traces flushed.\n"_literal);
+    return;
+  }
+  auto &site = trace_sites[where];
+  if (what == "start") {
+    site.started++;
+    console::log(console::channel::jit, console::priority::debug,
+                 "Trace "_literal, trace, " started at "_literal, where,
+                 "\n"_literal);
+  } else if (what == "stop") {
+    site.stopped++;
+    console::log(console::channel::jit, console::priority::debug,
+                 "Trace "_literal, trace, " compiled at "_literal, where,
+                 "\n"_literal);
+  } else if (what == "abort") {
+    site.aborted++;
+    site.reason = reason;
+    console::log(console::channel::jit, console::priority::notice,
+                 "Trace "_literal, trace, " from "_literal, where,
+                 " aborted: "_literal, reason, "\n"_literal);
+    if (blacklisted && !site.blacklisted) {
+      console::log(console::channel::jit, console::priority::warning, where,
+                   " is blacklisted after "_literal, site.aborted,
+                   " aborts, it stays interpreted. Last abort: "_literal,
+                   reason, "\n"_literal);
+    }
+    site.blacklisted = site.blacklisted || blacklisted;
+  }
+}
+
+/// Turns `jit.attach` trace events into `trace_event` calls, given it. Returns
+/// the handler to attach.
+static constexpr char trace_prelude[] = R"lua(
+local report = ...
+local util = require("jit.util")
+-- Only installed with LuaJIT's Lua modules, without it errors are numbers
+local has_vmdef, vmdef = pcall(require, "jit.vmdef")
+if not has_vmdef then vmdef = nil end
+local band = bit.band
+
+local function where(func, pc)
+  local info = util.funcinfo(func, pc)
+  if info.ffid then
+    return "[builtin#" .. info.ffid .. "]"
+  end
+  return (info.source or "?"):gsub("^@", "") .. ":" .. (info.currentline or 0)
+end
+
+local function reason(err, info)
+  if vmdef == nil or vmdef.traceerr[err] == nil then
+    return "trace error " .. tostring(err)
+  end
+  if type(info) == "function" then
+    info = where(info, 0)
+  elseif type(info) == "number" and
+         vmdef.traceerr[err]:find("bytecode %d", 1, true) then
+    -- Reads better with the bytecode's name than its number
+    info = vmdef.bcnames:sub(info * 6 + 1, info * 6 + 6):gsub(" +$", "")
+  end
+  local ok, message = pcall(string.format, vmdef.traceerr[err], info)
+  return ok and message or vmdef.traceerr[err]
+end
+
+-- Penalized too often, a loop or function is patched to ILOOP, IFORL,
+-- IITERL or IFUNCF/V and never recorded again
+local function blacklisted(func, pc)
+  if vmdef == nil then return false end
+  local ins = util.funcbc(func, pc)
+  if ins == nil then return false end
+  local op = band(ins, 0xff)
+  return vmdef.bcnames:sub(op * 6 + 1, op * 6 + 6):match("^I[LFI]") ~= nil
+end
+
+-- Where each trace being recorded started
+local starts = {}
+
+return function(what, trace, func, pc, err, info)
+  if what == "flush" then
+    starts = {}
+    report(what, 0, "", "", false)
+  elseif what == "start" then
+    local start = where(func, pc)
+    starts[trace] = { func = func, pc = pc, where = start }
+    report(what, trace, start, "", false)
+  else
+    local start = starts[trace]
+    starts[trace] = nil
+    if start == nil then
+      start = { func = func, pc = pc, where = where(func, pc) }
+    end
+    if what == "abort" then
+      report(what, trace, start.where,
+             reason(err, info) .. " at " .. where(func, pc),
+             blacklisted(start.func, start.pc))
+    else
+      report(what, trace, start.where, "", false)
+    end
+  end
+end
+)lua";
+
+/// Call `jit.attach` with the trace handler, and maybe the event to attach to
+static bool attach_traces(const char *event) {
+  lua_getglobal(L, "jit");
+  lua_getfield(L, -1, "attach");
+  lua_remove(L, -2);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, trace_handler);
+  if (event != nullptr) {
+    lua_pushstring(L, event);
+  }
+  if (lua_pcall(L, event != nullptr ? 2 : 1, 0, 0) != 0) {
+    console::log(console::channel::jit, console::priority::error,
+                 "Can't attach to trace events: "_literal, lua_tostring(L, -1),
+                 "\n"_literal);
+    lua_pop(L, 1);
+    return false;
+  }
+  return true;
+}
+
+void lua::watch_traces(bool watch /**< [in] watch or stop watching */) {
+  if (L == nullptr || watch == (trace_handler != LUA_NOREF)) {
+    return;
+  }
+  if (!watch) {
+    // Attaching without an event detaches
+    attach_traces(nullptr);
+    luaL_unref(L, LUA_REGISTRYINDEX, trace_handler);
+    trace_handler = LUA_NOREF;
+    return;
+  }
+  if (luaL_loadbuffer(L, trace_prelude, sizeof(trace_prelude) - 1,
+                      "=trace_prelude") != 0) {
+    console::log(console::channel::jit, console::priority::error,
+                 "Can't load the trace handler: "_literal, lua_tostring(L, -1),
+                 "\n"_literal);
+    lua_pop(L, 1);
+    return;
+  }
+  lua::bind::push<&trace_event>(L);
+  if (lua_pcall(L, 1, 1, 0) != 0) {
+    console::log(console::channel::jit, console::priority::error,
+                 "Can't make the trace handler: "_literal, lua_tostring(L, -1),
+                 "\n"_literal);
+    lua_pop(L, 1);
+    return;
+  }
+  trace_handler = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (!attach_traces("trace")) {
+    luaL_unref(L, LUA_REGISTRYINDEX, trace_handler);
+    trace_handler = LUA_NOREF;
+  }
+}
+
+void lua::report_traces() {
+  auto sites = std::vector<const std::pair<const std::string, trace_site> *>{};
+  for (auto &&site : trace_sites) {
+    if (site.second.aborted > 0) {
+      sites.emplace_back(&site);
+    }
+  }
+  console::log(console::channel::jit, console::priority::informational,
+               "Trace aborts at "_literal, sites.size(), " of "_literal,
+               trace_sites.size(), " places traces started.\n"_literal);
+  auto shown = std::min(sites.size(), reported_sites);
+  std::partial_sort(sites.begin(), sites.begin() + shown, sites.end(),
+                    [](auto &&a, auto &&b) {
+                      return a->second.aborted > b->second.aborted;
+                    });
+  for (auto i = std::size_t{0}; i < shown; i++) {
+    auto &&[where, site] = *sites[i];
+    console::log(console::channel::jit, console::priority::informational,
+                 "  "_literal, site.aborted, " aborts, "_literal, site.stopped,
+                 " of "_literal, site.started, " compiled"_literal,
+                 site.blacklisted ? ", blacklisted"_literal : ""_literal,
+                 ", at "_literal, where, ". Last abort: "_literal, site.reason,
+                 "\n"_literal);
+  }
+}
+
 // =============================================================================
 // Lua <-> C calls
 // =============================================================================
 
-static int init_vulkan(lua_State *L0) {
-  // access "celerygame.app"
-  lua_pushstring(L0, "app");
-  lua_rawget(L0, 1);
-  auto &&app = lua_tostring(L0, -1);
-  lua_pop(L0, 1);
-  // access "celerygame.vsn"
-  lua_pushstring(L0, "vsn");
-  lua_rawget(L0, 1);
-  auto &&vsn = static_cast<U32>(lua_tointeger(L0, -1));
-  lua_pop(L0, 2);
+/// Adds a traceback to errors raised by callbacks
+static int traceback(lua_State *L0) {
+  auto &&message = lua_tostring(L0, 1);
+  luaL_traceback(L0, L0, message != nullptr ? message : "(not a string)", 1);
+  return 1;
+}
 
-  // init all we need
+/// Call a function by registry reference with no arguments, leaving `results`
+/// results on the stack. Errors are logged, leaving nothing on the stack.
+static bool call(int ref, int results, const char *what) {
+  auto charge = charge_to{what};
+  lua_rawgeti(L, LUA_REGISTRYINDEX, error_handler);
+  auto handler = lua_gettop(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  if (lua_pcall(L, 0, results, handler) != 0) {
+    console::log(console::channel::lua, console::priority::error,
+                 "The Lua "_literal, what, " encountered an error: "_literal,
+                 lua_tostring(L, -1), "\n"_literal);
+    lua_pop(L, 2);
+    return false;
+  }
+  lua_remove(L, handler);
+  return true;
+}
+
+/// Phases by the names Lua knows them by, in order
+static constexpr const char *phase_names[] = {"input", "simulate", "render",
+                                              "present", nullptr};
+
+/// Phases pass by name
+template <> struct lua::bind::value<runloop::phase> {
+  static constexpr int keys = 0;
+  static void push_keys(lua_State *) {}
+  static runloop::phase get(lua_State *L0, int index, int) {
+    return static_cast<runloop::phase>(
+        luaL_checkoption(L0, index, nullptr, phase_names));
+  }
+  static void push(lua_State *L0, runloop::phase from, int) {
+    lua_pushstring(L0, runloop::phase_name(from));
+  }
+};
+
+template <> struct lua::bind::members<runloop::task_stats> {
+  using T = runloop::task_stats;
+  static constexpr auto value = std::tuple{
+      field("name", &T::name),         field("phase", &T::when),
+      field("performs", &T::performs), field("p50", &T::p50),
+      field("p95", &T::p95),           field("p99", &T::p99),
+      field("max", &T::max),           field("budget", &T::budget),
+      field("overruns", &T::overruns)};
+};
+
+template <> struct lua::bind::members<runloop::schedule> {
+  using T = runloop::schedule;
+  static constexpr auto value = std::tuple{
+      field("simulation_rate", &T::simulation_rate),
+      field("frame_rate", &T::frame_rate),
+      field("max_steps", &T::max_steps),
+      field("spin", &T::spin),
+      field("measure_tasks", &T::measure_tasks),
+      field("report_interval", &T::report_interval),
+      field("idle", &T::idle),
+      field("idle_delay", &T::idle_delay)};
+};
+
+/// A schedule from Lua, keys left out keep their current values
+struct schedule_changes : runloop::schedule {
+  schedule_changes() : runloop::schedule{runloop::get_schedule()} {}
+};
+
+template <>
+struct lua::bind::members<schedule_changes>
+    : lua::bind::members<runloop::schedule> {};
+
+static void update_schedule(const schedule_changes &changes) {
+  runloop::set_schedule(changes);
+}
+
+template <> struct lua::bind::members<lua::collector> {
+  using T = lua::collector;
+  static constexpr auto value =
+      std::tuple{field("budget", &T::budget), field("step", &T::step),
+                 field("floor", &T::floor)};
+};
+
+template <> struct lua::bind::members<lua::memory_stats> {
+  using T = lua::memory_stats;
+  static constexpr auto value = std::tuple{
+      field("live", &T::live),         field("peak", &T::peak),
+      field("pooled", &T::pooled),     field("steps", &T::steps),
+      field("cycles", &T::cycles),     field("backlogs", &T::backlogs),
+      field("collecting", &T::collecting)};
+};
+
+template <> struct lua::bind::members<lua::account_stats> {
+  using T = lua::account_stats;
+  static constexpr auto value =
+      std::tuple{field("name", &T::name), field("allocations", &T::allocations),
+                 field("bytes", &T::bytes)};
+};
+
+static void init_vulkan(const char *app, U32 vsn) {
   celerygame::vulkan::init();
   celerygame::vulkan::window::init(
       app + (" " + celerygame::vulkan::utils::stringify_version_info(vsn)),
       {1280, 720}, false);
   celerygame::vulkan::instance::init(app, vsn, true, {}, {});
-  return 0;
 }
 
-static int deinit_vulkan(lua_State *L0) {
-  lua_pop(L0, 1);
+static void deinit_vulkan() {
   celerygame::vulkan::instance::deinit();
   celerygame::vulkan::window::deinit();
   celerygame::vulkan::deinit();
-  return 0;
 }
 
+/// Event types Lua knows by name
+static constexpr auto named_event_types = std::array<U32, 8>{
+    SDL_QUIT,          SDL_KEYDOWN,         SDL_KEYUP,
+    SDL_MOUSEMOTION,   SDL_MOUSEBUTTONDOWN, SDL_MOUSEBUTTONUP,
+    SDL_MOUSEWHEEL,    SDL_WINDOWEVENT};
+
+/// The name Lua knows an event type by, nullptr if it has none
+static const char *event_type_name(U32 type) {
+  switch (type) {
+  case SDL_QUIT:
+    return "quit";
+  case SDL_KEYDOWN:
+    return "key_down";
+  case SDL_KEYUP:
+    return "key_up";
+  case SDL_MOUSEMOTION:
+    return "mouse_motion";
+  case SDL_MOUSEBUTTONDOWN:
+    return "mouse_button_down";
+  case SDL_MOUSEBUTTONUP:
+    return "mouse_button_up";
+  case SDL_MOUSEWHEEL:
+    return "mouse_wheel";
+  case SDL_WINDOWEVENT:
+    return "window";
+  default:
+    return nullptr;
+  }
+}
+
+/// Push an event as a table
+static void push_event(lua_State *L0, const runloop::event &e) {
+  lua_createtable(L0, 0, 12);
+  if (auto name = event_type_name(e.type); name != nullptr) {
+    lua_pushstring(L0, name);
+    lua_setfield(L0, -2, "type");
+  }
+  lua_pushinteger(L0, e.type);
+  lua_setfield(L0, -2, "sdl_type");
+  lua_pushinteger(L0, e.timestamp);
+  lua_setfield(L0, -2, "timestamp");
+  lua_pushinteger(L0, e.window);
+  lua_setfield(L0, -2, "window");
+  lua_pushinteger(L0, e.code);
+  lua_setfield(L0, -2, "code");
+  lua_pushinteger(L0, e.key);
+  lua_setfield(L0, -2, "key");
+  lua_pushinteger(L0, e.x);
+  lua_setfield(L0, -2, "x");
+  lua_pushinteger(L0, e.y);
+  lua_setfield(L0, -2, "y");
+  lua_pushinteger(L0, e.dx);
+  lua_setfield(L0, -2, "dx");
+  lua_pushinteger(L0, e.dy);
+  lua_setfield(L0, -2, "dy");
+  lua_pushinteger(L0, e.modifiers);
+  lua_setfield(L0, -2, "modifiers");
+  lua_pushinteger(L0, e.state);
+  lua_setfield(L0, -2, "state");
+  lua_pushinteger(L0, e.repeats);
+  lua_setfield(L0, -2, "repeats");
+}
+
+/// Polling outside of any task, e.g. from timers and coroutines
+static auto untasked_events = lua::event_cursor{};
+/// Whose cursor `poll_event` advances, the task being performed's if any
+static auto polling_events = &untasked_events;
+
 static int poll_event(lua_State *L0) {
   lua_pop(L0, 1);
-  SDL_Event event;
-  if(SDL_PollEvent(&event)) {
-    switch (event.type) {
-    case SDL_QUIT:
-      lua_newtable(L0);
-      lua_pushstring(L0, "quit");
-      lua_setfield(L0, -2, "type");
-      return 1;
-    default:
-      lua_newtable(L0);
-      lua_pushnil(L0);
-      lua_setfield(L0, -2, "type");
-      return 1;
-    }
+  auto events = runloop::events();
+  auto &cursor = *polling_events;
+  // Events are pumped once per tick, so a new frame starts them over
+  if (cursor.frame != runloop::current().number) {
+    cursor.frame = runloop::current().number;
+    cursor.polled = 0;
+  }
+  if (cursor.polled < events.size()) {
+    push_event(L0, events[cursor.polled++]);
   } else {
     lua_pushnil(L0);
-    return 1;
   }
+  return 1;
+}
+
+static int events(lua_State *L0) {
+  lua_pop(L0, 1);
+  auto events = runloop::events();
+  lua_createtable(L0, static_cast<int>(events.size()), 0);
+  for (auto i = std::size_t{0}; i < events.size(); i++) {
+    push_event(L0, events[i]);
+    lua_rawseti(L0, -2, static_cast<int>(i + 1));
+  }
+  return 1;
+}
+
+static void zone_begin(const char *name) {
+  profiler::begin(profiler::enabled() ? profiler::intern(name) : nullptr);
 }
 
+static void set_task_budget(std::string_view name, F64 seconds) {
+  for (auto &&stats : runloop::all_stats()) {
+    if (name == stats.name) {
+      runloop::set_budget(stats.task, seconds);
+    }
+  }
+}
+
+/// Call a timer's Lua function, its context is the function's reference
+static void lua_timer_fired(void *context) {
+  auto ref = static_cast<int>(reinterpret_cast<std::intptr_t>(context));
+  auto found = lua_timers.find(ref);
+  if (found == lua_timers.end()) {
+    return;
+  }
+  auto periodic = found->second.periodic;
+  auto failed = !call(ref, 0, "timer");
+  // The callback may have cancelled itself
+  found = lua_timers.find(ref);
+  if (found != lua_timers.end() && (!periodic || failed)) {
+    runloop::cancel_timer(found->second.timer);
+    lua_timers.erase(found);
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  }
+}
+
+/// Start a timer calling the function at 3 after 2 seconds, every period
+static int start_lua_timer(lua_State *L0, bool periodic) {
+  // "celerygame" is 1, the seconds are 2, the function is 3
+  auto &&seconds = luaL_checknumber(L0, 2);
+  luaL_checktype(L0, 3, LUA_TFUNCTION);
+  lua_pushvalue(L0, 3);
+  auto ref = luaL_ref(L0, LUA_REGISTRYINDEX);
+  lua_pop(L0, 3);
+  auto timer = runloop::start_timer(
+      seconds, periodic ? seconds : 0.0, lua_timer_fired,
+      reinterpret_cast<void *>(static_cast<std::intptr_t>(ref)));
+  lua_timers.emplace(ref, lua_timer{timer, periodic});
+  lua_pushinteger(L0, ref);
+  return 1;
+}
+
+static int after(lua_State *L0) { return start_lua_timer(L0, false); }
+
+static int every(lua_State *L0) { return start_lua_timer(L0, true); }
+
+static int cancel_timer(lua_State *L0) {
+  // "celerygame" is 1, the timer is 2
+  auto ref = static_cast<int>(luaL_checkinteger(L0, 2));
+  lua_pop(L0, 2);
+  auto found = lua_timers.find(ref);
+  auto cancelled = found != lua_timers.end() &&
+                   runloop::cancel_timer(found->second.timer);
+  if (found != lua_timers.end()) {
+    lua_timers.erase(found);
+    luaL_unref(L0, LUA_REGISTRYINDEX, ref);
+  }
+  lua_pushboolean(L0, cancelled);
+  return 1;
+}
+
+static int add_task(lua_State *L0) {
+  // "celerygame" is 1, the phase is 2, the function is 3, the name is 4
+  auto when = lua::bind::value<runloop::phase>::get(L0, 2, 0);
+  luaL_checktype(L0, 3, LUA_TFUNCTION);
+  auto &&name = profiler::intern(luaL_optstring(L0, 4, "lua::task"));
+  lua_pushvalue(L0, 3);
+  auto ref = luaL_ref(L0, LUA_REGISTRYINDEX);
+  lua_settop(L0, 0);
+  lua_tasks[ref] = runloop::add(
+      std::make_unique<lua::scripted_task>(ref, when), name);
+  lua_pushinteger(L0, ref);
+  return 1;
+}
+
+static int remove_task(lua_State *L0) {
+  // "celerygame" is 1, the task is 2
+  auto ref = static_cast<int>(luaL_checkinteger(L0, 2));
+  lua_pop(L0, 2);
+  auto found = lua_tasks.find(ref);
+  auto removed = found != lua_tasks.end() && runloop::contains(found->second);
+  if (removed) {
+    runloop::remove(found->second);
+  }
+  lua_pushboolean(L0, removed);
+  return 1;
+}
+
+static std::tuple<const runloop::event *, std::size_t> raw_events() {
+  auto events = runloop::events();
+  return {events.data(), events.size()};
+}
+
+static const runloop::frame *raw_frame() { return &runloop::current(); }
+
+// =============================================================================
+// LuaJIT FFI views of engine memory
+// =============================================================================
+
+// These declarations have to match the engine's structs field for field
+static_assert(sizeof(runloop::event) == 40 &&
+                  offsetof(runloop::event, dy) == 32 &&
+                  offsetof(runloop::event, repeats) == 39,
+              "runloop::event doesn't match its FFI declaration");
+static_assert(sizeof(runloop::frame) == 24 &&
+                  offsetof(runloop::frame, alpha) == 20,
+              "runloop::frame doesn't match its FFI declaration");
+
+/// Declares the engine's structs to the FFI, and wraps the raw pointers the C
+/// side hands out so scripts read engine memory without building tables
+static constexpr char ffi_prelude[] = R"lua(
+local ffi = require("ffi")
+ffi.cdef[[
+typedef struct celerygame_event {
+  uint32_t type, timestamp, window;
+  int32_t code, key, x, y, dx, dy;
+  uint16_t modifiers;
+  uint8_t state, repeats;
+} celerygame_event;
+typedef struct celerygame_frame {
+  uint64_t number;
+  double timestep;
+  uint32_t steps;
+  float alpha;
+} celerygame_frame;
+]]
+local event_pointer = ffi.typeof("const celerygame_event *")
+local raw_events = celerygame.raw_events
+
+-- This tick's events as a 0-based array, and how many there are. Only valid
+-- until the next tick.
+function celerygame:event_view()
+  local events, count = raw_events(self)
+  return ffi.cast(event_pointer, events), count
+end
+
+-- The frame being ticked, read live from the run loop
+celerygame.frame = ffi.cast("const celerygame_frame *", celerygame:raw_frame())
+)lua";
+
 // =============================================================================
 // Lua state handling
 // =============================================================================
 
-void lua::init(std::filesystem::path &&init_file) {
-  console::log(console::priority::notice, "Starting Lua runtime.\n");
-  L = luaL_newstate();
+void lua::init(std::filesystem::path &&init_file,
+               std::filesystem::path &&cache) {
+  console::log(console::channel::lua, console::priority::notice,
+               "Starting Lua runtime.\n"_literal);
+  current_memory = memory_stats{};
+  memory_accounts.resize(1);
+  memory_accounts.front() = account_stats{"engine", 0, 0};
+  L = lua_newstate(&allocate, nullptr);
+  engine_allocator = L != nullptr;
+  if (!engine_allocator) {
+    console::log(console::channel::lua, console::priority::warning,
+                 "This LuaJIT can't use the engine's allocator, Lua memory "
+                 "comes from its own.\n"_literal);
+    L = luaL_newstate();
+  }
   luaL_openlibs(L);
+  script_root = init_file.parent_path();
+  cache_directory = std::move(cache);
+  cache_hits = cache_misses = 0;
+
+  // Modules resolve through the bytecode cache before `package.path`
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "loaders");
+  for (auto i = static_cast<int>(lua_objlen(L, -1)); i >= 2; i--) {
+    lua_rawgeti(L, -1, i);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_pushcfunction(L, &cached_loader);
+  lua_rawseti(L, -2, 2);
+  lua_pop(L, 2);
+  lua_pushcfunction(L, &traceback);
+  error_handler = luaL_ref(L, LUA_REGISTRYINDEX);
   lua_newtable(L);
   lua_setglobal(L, "celerygame");
 
   // add methods
   lua_getglobal(L, "celerygame");
 
-  lua_pushcfunction(L, &init_vulkan);
-  lua_setfield(L, -2, "init_vulkan");
-  lua_pushcfunction(L, &deinit_vulkan);
-  lua_setfield(L, -2, "deinit_vulkan");
+  lua::bind::method<&init_vulkan>(L, "init_vulkan");
+  lua::bind::method<&deinit_vulkan>(L, "deinit_vulkan");
+  lua::bind::method<&zone_begin>(L, "zone_begin");
+  lua::bind::method<&profiler::end>(L, "zone_end");
+  lua::bind::method<&runloop::all_stats>(L, "task_stats");
+  lua::bind::method<&set_task_budget>(L, "set_task_budget");
+  lua::bind::method<&runloop::get_schedule>(L, "schedule");
+  lua::bind::method<&update_schedule>(L, "set_schedule");
+  lua::bind::method<&runloop::keep_awake>(L, "keep_awake");
+  lua::bind::method<&raw_events>(L, "raw_events");
+  lua::bind::method<&raw_frame>(L, "raw_frame");
+  lua::bind::method<&lua::get_collector>(L, "collector");
+  lua::bind::method<&lua::set_collector>(L, "set_collector");
+  lua::bind::method<&lua::memory>(L, "memory");
+  lua::bind::method<&lua::accounts>(L, "memory_accounts");
+  lua::bind::method<&lua::start_sampling>(L, "start_sampling");
+  lua::bind::method<&lua::stop_sampling>(L, "stop_sampling");
+  lua::bind::method<&lua::is_sampling>(L, "is_sampling");
+  lua::bind::method<&lua::watch_traces>(L, "watch_traces");
+  lua::bind::method<&lua::report_traces>(L, "report_traces");
+  lua::workers::bind(L);
+  // These handle the stack themselves
   lua_pushcfunction(L, &poll_event);
   lua_setfield(L, -2, "poll_event");
+  lua_pushcfunction(L, &events);
+  lua_setfield(L, -2, "events");
+  lua_pushcfunction(L, &after);
+  lua_setfield(L, -2, "after");
+  lua_pushcfunction(L, &every);
+  lua_setfield(L, -2, "every");
+  lua_pushcfunction(L, &cancel_timer);
+  lua_setfield(L, -2, "cancel_timer");
+  lua_pushcfunction(L, &add_task);
+  lua_setfield(L, -2, "add_task");
+  lua_pushcfunction(L, &remove_task);
+  lua_setfield(L, -2, "remove_task");
+
+  // FFI events only have SDL's numbers for types, so give scripts the names
+  lua_createtable(L, 0, static_cast<int>(named_event_types.size()));
+  for (auto type : named_event_types) {
+    lua_pushinteger(L, type);
+    lua_setfield(L, -2, event_type_name(type));
+  }
+  lua_setfield(L, -2, "event_types");
+
+  if (luaL_loadbuffer(L, ffi_prelude, sizeof(ffi_prelude) - 1,
+                      "=ffi_prelude") != 0 ||
+      lua_pcall(L, 0, 0, 0) != 0) {
+    console::log(console::channel::lua, console::priority::error,
+                 "Can't declare engine structs to the FFI: "_literal,
+                 lua_tostring(L, -1), "\n"_literal);
+    lua_pop(L, 1);
+  }
 
-  auto error_code = luaL_dofile(L, init_file.string().c_str());
-  if (error_code != 0) {
-    console::log(console::priority::error,
-                 "Can't initialize Lua runloop. Error is ",
-                 std::to_string(error_code), "\n");
+  {
+    auto charge = charge_to{"init file"};
+    auto error_code = load_script(L, init_file);
+    if (error_code == 0) {
+      error_code = lua_pcall(L, 0, LUA_MULTRET, 0);
+    }
+    if (error_code != 0) {
+      console::log(console::channel::lua, console::priority::error,
+                   "Can't initialize Lua runloop. Error is "_literal,
+                   error_code, "\n"_literal);
+    }
   }
+  lua_settop(L, 0);
+
+  // resolve the callbacks once, they're called by reference from here on
+  lua_getglobal(L, "celerygame");
+  lua_getfield(L, -1, "init_callback");
+  init_callback = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_getfield(L, -1, "runloop_callback");
+  runloop_callback = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_getfield(L, -1, "deinit_callback");
+  deinit_callback = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pop(L, 1);
+
   // call constructor
-  lua_pushstring(L, "init_callback");
-  lua_rawget(L, 1);
-  lua_pcall(L, 0, 0, 0);
+  call(init_callback, 0, "init callback");
+
+  // From here on garbage is only collected at the end of frames
+  collected_live = in_use();
+  lua_gc(L, LUA_GCSTOP, 0);
+  collector_task = runloop::add(runloop::phase::present, &collect_garbage,
+                                nullptr, runloop::affinity::main_thread,
+                                "lua::collect_garbage");
 }
 
-void lua::scripted_task::perform() {
+lua::scripted_task::scripted_task()
+    : task{runloop::phase::input, runloop::affinity::main_thread},
+      _callback{LUA_NOREF} {
+  scripted_tasks++;
+}
+
+lua::scripted_task::scripted_task(
+    int callback /**< [in] registry reference to the function */,
+    runloop::phase when /**< [in] when the function runs in a frame */)
+    : task{when, runloop::affinity::main_thread}, _callback{callback} {
+  scripted_tasks++;
+}
+
+lua::scripted_task::~scripted_task() {
+  scripted_tasks--;
+  // The state may already be closed, which freed the reference with it
+  if (_callback != LUA_NOREF && L != nullptr) {
+    lua_tasks.erase(_callback);
+    luaL_unref(L, LUA_REGISTRYINDEX, _callback);
+  }
+}
+
+void lua::scripted_task::perform(const runloop::frame &current) {
   // don't exec when we want to quit
   if (!_shall_quit) {
-    lua_getglobal(L, "celerygame");
-    lua_pushstring(L, "runloop_callback");
-    lua_rawget(L, 1);
-    if (!lua_pcall(L, 0, 1, 0)) {
-      // unsafe when we get an error (lua_pcall != 0) so we wrap
+    auto scope = profiler::zone{"lua::scripted_task"};
+    auto callback = _callback;
+    if (callback == LUA_NOREF) {
+      callback = runloop_callback;
+    }
+    polling_events = &_events;
+    auto called = call(callback, 1, "task");
+    polling_events = &untasked_events;
+    if (called) {
       _shall_quit = lua_toboolean(L, -1);
       lua_pop(L, 1);
     } else {
-      console::log(console::priority::error,
-                    "The Lua runloop encountered an error.\n");
       _shall_quit = true;
     }
-    lua_pop(L, 1);
   }
 }
 
 void lua::deinit() {
-  console::log(console::priority::notice, "Closing Lua runtime.\n");
+  console::log(console::channel::lua, console::priority::notice,
+               "Closing Lua runtime.\n"_literal);
 
   // call destructor
-  lua_getglobal(L, "celerygame");
-  lua_pushstring(L, "deinit_callback");
-  lua_rawget(L, 1);
-  lua_pcall(L, 0, 0, 0);
+  call(deinit_callback, 0, "deinit callback");
+  lua::workers::deinit();
+  stop_sampling();
+  if (trace_handler != LUA_NOREF) {
+    watch_traces(false);
+    report_traces();
+  }
+  trace_sites.clear();
+
+  // Timers can't call into the state once it's closed
+  for (auto &&[ref, timer] : lua_timers) {
+    runloop::cancel_timer(timer.timer);
+  }
+  lua_timers.clear();
+
+  if (runloop::contains(collector_task)) {
+    runloop::remove(collector_task);
+  }
+  auto stats = memory();
+  console::log(console::channel::lua, console::priority::informational,
+               "Lua memory: "_literal, stats.live / 1024, " KiB live, "_literal,
+               stats.peak / 1024, " KiB peak, "_literal, stats.cycles,
+               " collector cycles in "_literal, stats.collecting * 1000.0,
+               " ms, "_literal, stats.backlogs, " frames behind.\n"_literal);
+  console::log(console::channel::lua, console::priority::informational,
+               "Lua bytecode cache: "_literal, cache_hits,
+               " scripts loaded, "_literal, cache_misses,
+               " compiled.\n"_literal);
+  for (auto &&account : memory_accounts) {
+    console::log(console::channel::lua, console::priority::informational,
+                 "Lua memory charged to "_literal, account.name, ": "_literal,
+                 account.allocations, " allocations, "_literal,
+                 account.bytes / 1024, " KiB.\n"_literal);
+  }
 
+  // Tasks outliving the state have nothing to unreference
   lua_close(L);
+  L = nullptr;
+  lua_tasks.clear();
+  block_chunks.clear();
+  block_free = {};
+  engine_allocator = false;
+  error_handler = init_callback = runloop_callback = deinit_callback =
+      LUA_NOREF;
 }
\ No newline at end of file
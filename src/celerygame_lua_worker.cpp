@@ -0,0 +1,498 @@
+// Celerygame Lua worker states
+//
+// Copyright 2021 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "../include/celerygame_lua_worker.hpp"
+#include "../include/celerygame_console.hpp"
+#include "../include/celerygame_lua_bind.hpp"
+#include "../include/celerygame_runloop.hpp"
+using namespace celerygame;
+
+// =============================================================================
+// Messages
+// =============================================================================
+
+/// What the next value in a message is
+enum class tag : U8 { nil, no, yes, number, string, table };
+
+/// Deepest tables can nest in a message, which also catches cycles
+static constexpr auto max_depth = 32;
+
+static constexpr char message_metatable[] = "celerygame.message";
+
+lua::message::message(std::vector<U8> &&bytes /**< [in] a serialized value */)
+    : _bytes{std::move(bytes)} {}
+
+std::span<const U8> lua::message::bytes() const { return _bytes; }
+
+std::string_view lua::message::blob() const {
+  if (_bytes.empty() || static_cast<tag>(_bytes.front()) != tag::string) {
+    return std::string_view{};
+  }
+  return std::string_view{reinterpret_cast<const char *>(_bytes.data()) + 1 +
+                              sizeof(U32),
+                          _bytes.size() - 1 - sizeof(U32)};
+}
+
+/// The message a userdata at a stack index holds, nullptr if it isn't one
+static lua::shared_message *as_message(lua_State *L0, int index) {
+  if (lua_type(L0, index) != LUA_TUSERDATA || !lua_getmetatable(L0, index)) {
+    return nullptr;
+  }
+  luaL_getmetatable(L0, message_metatable);
+  auto same = lua_rawequal(L0, -1, -2);
+  lua_pop(L0, 2);
+  return same ? static_cast<lua::shared_message *>(lua_touserdata(L0, index))
+              : nullptr;
+}
+
+template <class T> static void append(std::vector<U8> &into, T value) {
+  auto at = into.size();
+  into.resize(at + sizeof(T));
+  std::memcpy(into.data() + at, &value, sizeof(T));
+}
+
+static void encode_value(lua_State *L0, int index, std::vector<U8> &into,
+                         int depth) {
+  switch (lua_type(L0, index)) {
+  case LUA_TNIL:
+    into.push_back(static_cast<U8>(tag::nil));
+    break;
+  case LUA_TBOOLEAN:
+    into.push_back(
+        static_cast<U8>(lua_toboolean(L0, index) ? tag::yes : tag::no));
+    break;
+  case LUA_TNUMBER:
+    into.push_back(static_cast<U8>(tag::number));
+    append(into, static_cast<F64>(lua_tonumber(L0, index)));
+    break;
+  case LUA_TSTRING: {
+    auto size = std::size_t{0};
+    auto &&str = lua_tolstring(L0, index, &size);
+    into.push_back(static_cast<U8>(tag::string));
+    append(into, static_cast<U32>(size));
+    into.insert(into.end(), str, str + size);
+    break;
+  }
+  case LUA_TTABLE: {
+    if (depth >= max_depth) {
+      throw std::invalid_argument{"Tables nest too deep to send"};
+    }
+    if (!lua_checkstack(L0, 3)) {
+      throw std::runtime_error{"Out of Lua stack sending a table"};
+    }
+    into.push_back(static_cast<U8>(tag::table));
+    // The pairs are counted as they're written
+    auto count_at = into.size();
+    append(into, U32{0});
+    auto count = U32{0};
+    lua_pushnil(L0);
+    while (lua_next(L0, index) != 0) {
+      auto top = lua_gettop(L0);
+      encode_value(L0, top - 1, into, depth + 1);
+      encode_value(L0, top, into, depth + 1);
+      lua_pop(L0, 1);
+      count++;
+    }
+    std::memcpy(into.data() + count_at, &count, sizeof(U32));
+    break;
+  }
+  case LUA_TUSERDATA:
+    // Messages nest as they were serialized
+    if (auto m = as_message(L0, index); m != nullptr) {
+      auto bytes = (*m)->bytes();
+      into.insert(into.end(), bytes.begin(), bytes.end());
+      break;
+    }
+    [[fallthrough]];
+  default:
+    throw std::invalid_argument{std::string{"Can't send a "} +
+                                lua_typename(L0, lua_type(L0, index))};
+  }
+}
+
+lua::shared_message lua::encode(lua_State *L0 /**< [in] the Lua state */,
+                                int index /**< [in] the value's index */) {
+  // Sent on without serializing it again
+  if (auto m = as_message(L0, index); m != nullptr) {
+    return *m;
+  }
+  if (index < 0) {
+    index = lua_gettop(L0) + index + 1;
+  }
+  auto bytes = std::vector<U8>{};
+  encode_value(L0, index, bytes, 0);
+  return std::make_shared<const message>(std::move(bytes));
+}
+
+template <class T> static T read(const U8 *&at) {
+  auto value = T{};
+  std::memcpy(&value, at, sizeof(T));
+  at += sizeof(T);
+  return value;
+}
+
+/// Push the value at `at` and move past it. Only `encode` makes messages, so
+/// they're trusted to be well formed.
+static void decode_value(lua_State *L0, const U8 *&at) {
+  switch (static_cast<tag>(*at++)) {
+  case tag::nil:
+    lua_pushnil(L0);
+    break;
+  case tag::no:
+    lua_pushboolean(L0, false);
+    break;
+  case tag::yes:
+    lua_pushboolean(L0, true);
+    break;
+  case tag::number:
+    lua_pushnumber(L0, read<F64>(at));
+    break;
+  case tag::string: {
+    auto size = read<U32>(at);
+    lua_pushlstring(L0, reinterpret_cast<const char *>(at), size);
+    at += size;
+    break;
+  }
+  case tag::table: {
+    auto count = read<U32>(at);
+    lua_checkstack(L0, 3);
+    lua_createtable(L0, 0, static_cast<int>(count));
+    for (auto i = U32{0}; i < count; i++) {
+      decode_value(L0, at);
+      decode_value(L0, at);
+      lua_rawset(L0, -3);
+    }
+    break;
+  }
+  }
+}
+
+void lua::push(lua_State *L0 /**< [in] the Lua state */,
+               shared_message m /**< [in] the message */) {
+  new (lua_newuserdata(L0, sizeof(shared_message)))
+      shared_message{std::move(m)};
+  luaL_getmetatable(L0, message_metatable);
+  lua_setmetatable(L0, -2);
+}
+
+static const lua::shared_message &checked_message(lua_State *L0, int index) {
+  return *static_cast<lua::shared_message *>(
+      luaL_checkudata(L0, index, message_metatable));
+}
+
+static int message_gc(lua_State *L0) {
+  static_cast<lua::shared_message *>(lua_touserdata(L0, 1))->~shared_ptr();
+  return 0;
+}
+
+static int message_len(lua_State *L0) {
+  lua_pushinteger(L0, static_cast<lua_Integer>(
+                          checked_message(L0, 1)->bytes().size()));
+  return 1;
+}
+
+static int message_value(lua_State *L0) {
+  auto at = checked_message(L0, 1)->bytes().data();
+  decode_value(L0, at);
+  return 1;
+}
+
+/// The string a message holds as a pointer and size, nil if it isn't one.
+/// The pointer's valid while the message is.
+static int message_blob(lua_State *L0) {
+  auto blob = checked_message(L0, 1)->blob();
+  if (blob.data() == nullptr) {
+    lua_pushnil(L0);
+    return 1;
+  }
+  lua_pushlightuserdata(L0, const_cast<char *>(blob.data()));
+  lua_pushinteger(L0, static_cast<lua_Integer>(blob.size()));
+  return 2;
+}
+
+/// Add the message metatable to a state's registry
+static void bind_messages(lua_State *L0) {
+  luaL_newmetatable(L0, message_metatable);
+  lua_pushcfunction(L0, &message_gc);
+  lua_setfield(L0, -2, "__gc");
+  lua_pushcfunction(L0, &message_len);
+  lua_setfield(L0, -2, "__len");
+  lua_createtable(L0, 0, 2);
+  lua_pushcfunction(L0, &message_value);
+  lua_setfield(L0, -2, "value");
+  lua_pushcfunction(L0, &message_blob);
+  lua_setfield(L0, -2, "blob");
+  lua_setfield(L0, -2, "__index");
+  lua_pop(L0, 1);
+}
+
+/// Encode the value at an index and hand it on. If it can't be, the error's
+/// left on the stack to raise once nothing's left to destroy.
+template <class F> static bool encoded(lua_State *L0, int index, F &&then) {
+  auto top = lua_gettop(L0);
+  try {
+    then(lua::encode(L0, index));
+    return true;
+  } catch (const std::exception &e) {
+    lua_settop(L0, top);
+    lua_pushstring(L0, e.what());
+  }
+  return false;
+}
+
+// =============================================================================
+// Workers
+// =============================================================================
+
+/// A worker thread and the Lua state it owns
+struct worker_state {
+  std::size_t id;
+  lua::mailbox<lua::mailbox_capacity> inbox;  ///< From the main thread
+  lua::mailbox<lua::mailbox_capacity> outbox; ///< To the main thread
+  std::atomic<U32> posted{0};                 ///< Bumped to wake it up
+  std::thread thread;
+};
+
+static auto workers_running = std::vector<std::unique_ptr<worker_state>>{};
+static auto stopping = std::atomic<bool>{false};
+/// Which worker's outbox `receive` looks in first, so none are starved
+static auto next_outbox = std::size_t{0};
+
+/// `worker.post(value)`, the worker is upvalue 1
+static int worker_post(lua_State *L0) {
+  auto self =
+      static_cast<worker_state *>(lua_touserdata(L0, lua_upvalueindex(1)));
+  auto posted = false;
+  if (!encoded(L0, 1, [self, &posted](lua::shared_message &&m) {
+        posted = self->outbox.post(std::move(m));
+      })) {
+    return lua_error(L0);
+  }
+  // The run loop may be idling with nothing to wake it
+  if (posted) {
+    runloop::keep_awake();
+  }
+  lua_pushboolean(L0, posted);
+  return 1;
+}
+
+/// `worker.receive()`, the worker is upvalue 1
+static int worker_receive(lua_State *L0) {
+  auto self =
+      static_cast<worker_state *>(lua_touserdata(L0, lua_upvalueindex(1)));
+  if (auto m = self->inbox.take(); m != nullptr) {
+    lua::push(L0, std::move(m));
+  } else {
+    lua_pushnil(L0);
+  }
+  return 1;
+}
+
+/// A worker thread, handling what's posted to it until it's stopped
+static void run_worker(worker_state &self, std::filesystem::path script) {
+  // States aren't shared between threads, so each has LuaJIT's allocator
+  auto L0 = luaL_newstate();
+  luaL_openlibs(L0);
+  bind_messages(L0);
+  lua_createtable(L0, 0, 4);
+  lua_pushinteger(L0, static_cast<lua_Integer>(self.id + 1));
+  lua_setfield(L0, -2, "id");
+  lua_pushinteger(L0, static_cast<lua_Integer>(workers_running.size()));
+  lua_setfield(L0, -2, "count");
+  lua_pushlightuserdata(L0, &self);
+  lua_pushcclosure(L0, &worker_post, 1);
+  lua_setfield(L0, -2, "post");
+  lua_pushlightuserdata(L0, &self);
+  lua_pushcclosure(L0, &worker_receive, 1);
+  lua_setfield(L0, -2, "receive");
+  lua_setglobal(L0, "worker");
+
+  if (luaL_dofile(L0, script.string().c_str()) != 0) {
+    console::log(console::channel::lua, console::priority::error,
+                 "Lua worker "_literal, self.id + 1,
+                 " can't run its script: "_literal, lua_tostring(L0, -1),
+                 "\n"_literal);
+    lua_pop(L0, 1);
+  }
+  lua_getglobal(L0, "worker");
+  lua_getfield(L0, -1, "on_message");
+  auto handles = lua_isfunction(L0, -1);
+  auto on_message = luaL_ref(L0, LUA_REGISTRYINDEX);
+  lua_pop(L0, 1);
+  if (!handles) {
+    console::log(
+        console::channel::lua, console::priority::warning,
+        "Lua worker "_literal, self.id + 1,
+        " has no worker.on_message, messages to it are dropped.\n"_literal);
+  }
+
+  while (true) {
+    // Read before looking, a post after this wakes the wait right back up
+    auto seen = self.posted.load(std::memory_order_acquire);
+    if (auto m = self.inbox.take(); m != nullptr) {
+      if (!handles) {
+        continue;
+      }
+      lua_rawgeti(L0, LUA_REGISTRYINDEX, on_message);
+      lua::push(L0, std::move(m));
+      if (lua_pcall(L0, 1, 0, 0) != 0) {
+        console::log(console::channel::lua, console::priority::error,
+                     "Lua worker "_literal, self.id + 1,
+                     " encountered an error: "_literal, lua_tostring(L0, -1),
+                     "\n"_literal);
+        lua_pop(L0, 1);
+      }
+      continue;
+    }
+    if (stopping.load(std::memory_order_acquire)) {
+      break;
+    }
+    self.posted.wait(seen, std::memory_order_acquire);
+  }
+  lua_close(L0);
+}
+
+void lua::workers::init(std::size_t count /**< [in] worker threads */,
+                        std::filesystem::path &&script /**< [in] they run */) {
+  if (!workers_running.empty()) {
+    console::log(console::channel::lua, console::priority::warning,
+                 "Lua workers are already running.\n"_literal);
+    return;
+  }
+  console::log(console::channel::lua, console::priority::notice,
+               "Starting "_literal, count, " Lua workers running "_literal,
+               script.string(), "\n"_literal);
+  stopping.store(false, std::memory_order_relaxed);
+  // They all exist before any start, workers read how many there are
+  for (auto i = std::size_t{0}; i < count; i++) {
+    auto &self =
+        workers_running.emplace_back(std::make_unique<worker_state>());
+    self->id = i;
+  }
+  for (auto &&self : workers_running) {
+    self->thread = std::thread{run_worker, std::ref(*self), script};
+  }
+}
+
+std::size_t lua::workers::count() { return workers_running.size(); }
+
+bool lua::workers::post(std::size_t worker /**< [in] which worker */,
+                        shared_message m /**< [in] the message */) {
+  if (worker >= workers_running.size()) {
+    return false;
+  }
+  auto &self = *workers_running[worker];
+  if (!self.inbox.post(std::move(m))) {
+    return false;
+  }
+  self.posted.fetch_add(1, std::memory_order_release);
+  self.posted.notify_one();
+  return true;
+}
+
+std::size_t
+lua::workers::broadcast(const shared_message &m /**< [in] the message */) {
+  auto took = std::size_t{0};
+  for (auto i = std::size_t{0}; i < workers_running.size(); i++) {
+    took += post(i, m) ? 1 : 0;
+  }
+  return took;
+}
+
+bool lua::workers::receive(std::size_t &worker /**< [out] which worker */,
+                           shared_message &m /**< [out] the message */) {
+  for (auto i = std::size_t{0}; i < workers_running.size(); i++) {
+    auto from = (next_outbox + i) % workers_running.size();
+    if (auto taken = workers_running[from]->outbox.take(); taken != nullptr) {
+      worker = from;
+      m = std::move(taken);
+      next_outbox = from + 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+/// `celerygame:post(worker, value)`
+static int lua_post(lua_State *L0) {
+  // "celerygame" is 1, the worker is 2, the value is 3
+  auto worker = luaL_checkinteger(L0, 2);
+  auto posted = false;
+  if (!encoded(L0, 3, [worker, &posted](lua::shared_message &&m) {
+        posted = worker >= 1 && lua::workers::post(
+                                    static_cast<std::size_t>(worker - 1),
+                                    std::move(m));
+      })) {
+    return lua_error(L0);
+  }
+  lua_pushboolean(L0, posted);
+  return 1;
+}
+
+/// `celerygame:broadcast(value)`
+static int lua_broadcast(lua_State *L0) {
+  // "celerygame" is 1, the value is 2
+  auto took = std::size_t{0};
+  if (!encoded(L0, 2, [&took](lua::shared_message &&m) {
+        took = lua::workers::broadcast(m);
+      })) {
+    return lua_error(L0);
+  }
+  lua_pushinteger(L0, static_cast<lua_Integer>(took));
+  return 1;
+}
+
+/// `celerygame:receive()`, the message and which worker posted it, or nil
+static int lua_receive(lua_State *L0) {
+  auto worker = std::size_t{0};
+  auto m = lua::shared_message{};
+  if (!lua::workers::receive(worker, m)) {
+    lua_pushnil(L0);
+    return 1;
+  }
+  lua::push(L0, std::move(m));
+  lua_pushinteger(L0, static_cast<lua_Integer>(worker + 1));
+  return 2;
+}
+
+void lua::workers::bind(lua_State *L0 /**< [in] the main state */) {
+  bind_messages(L0);
+  lua::bind::method<&lua::workers::init>(L0, "start_workers");
+  lua::bind::method<&lua::workers::count>(L0, "worker_count");
+  lua_pushcfunction(L0, &lua_post);
+  lua_setfield(L0, -2, "post");
+  lua_pushcfunction(L0, &lua_broadcast);
+  lua_setfield(L0, -2, "broadcast");
+  lua_pushcfunction(L0, &lua_receive);
+  lua_setfield(L0, -2, "receive");
+}
+
+void lua::workers::deinit() {
+  if (workers_running.empty()) {
+    return;
+  }
+  stopping.store(true, std::memory_order_release);
+  for (auto &&self : workers_running) {
+    self->posted.fetch_add(1, std::memory_order_release);
+    self->posted.notify_one();
+  }
+  for (auto &&self : workers_running) {
+    self->thread.join();
+  }
+  workers_running.clear();
+  next_outbox = 0;
+  console::log(console::channel::lua, console::priority::notice,
+               "Stopped Lua workers.\n"_literal);
+}
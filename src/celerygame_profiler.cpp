@@ -0,0 +1,204 @@
+// Celerygame zone profiler
+//
+// Copyright 2021 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "../include/celerygame_profiler.hpp"
+#include "../include/celerygame_console.hpp"
+#include <unordered_set>
+using namespace celerygame;
+
+/// A finished zone
+struct zone_event {
+  const char *name;
+  U64 start;
+  U64 end;
+};
+
+/// Zones per chunk, a thread's buffer grows a chunk at a time
+static constexpr auto chunk_events = std::size_t{4096};
+/// Chunks a thread may fill before its zones get dropped
+static constexpr auto chunks_max = std::size_t{256};
+/// How deep `begin` zones may nest on one thread
+static constexpr auto open_zones_max = std::size_t{64};
+
+/// Zones recorded by one thread, only that thread writes to it
+struct thread_buffer {
+  U32 thread_id;
+  std::vector<std::unique_ptr<std::array<zone_event, chunk_events>>> chunks;
+  std::size_t used = chunk_events; ///< Events used in the last chunk
+  U64 dropped = 0;
+  std::array<zone_event, open_zones_max> open; ///< Zones from `begin`
+  std::size_t opened = 0;
+};
+
+static auto is_enabled = std::atomic<bool>{false};
+static auto trace_path = std::filesystem::path{};
+static auto buffers_mutex = std::mutex{};
+static auto buffers = std::vector<std::unique_ptr<thread_buffer>>{};
+static auto names = std::unordered_set<std::string>{};
+static thread_local thread_buffer *this_thread_buffer = nullptr;
+
+/// Find this thread's buffer, registering one the first time
+static thread_buffer &current_buffer() {
+  if (this_thread_buffer == nullptr) {
+    auto lock = std::lock_guard<std::mutex>{buffers_mutex};
+    buffers.emplace_back(std::make_unique<thread_buffer>());
+    this_thread_buffer = buffers.back().get();
+    this_thread_buffer->thread_id = static_cast<U32>(buffers.size());
+  }
+  return *this_thread_buffer;
+}
+
+void profiler::init(std::filesystem::path &&path /**< [in] trace file */) {
+  console::log(console::priority::notice,
+               "Recording profiler zones to '"_literal, path.string(),
+               "'.\n"_literal);
+  trace_path = std::move(path);
+  is_enabled.store(true, std::memory_order_release);
+}
+
+bool profiler::enabled() {
+  return is_enabled.load(std::memory_order_relaxed);
+}
+
+U64 profiler::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void profiler::record(const char *name /**< [in] the zone's name */,
+                      U64 start /**< [in] when the zone opened */,
+                      U64 end /**< [in] when the zone closed */) {
+  auto &buffer = current_buffer();
+  if (buffer.used == chunk_events) {
+    if (buffer.chunks.size() == chunks_max) {
+      buffer.dropped++;
+      return;
+    }
+    buffer.chunks.emplace_back(
+        std::make_unique<std::array<zone_event, chunk_events>>());
+    buffer.used = 0;
+  }
+  (*buffer.chunks.back())[buffer.used++] = zone_event{name, start, end};
+}
+
+void profiler::begin(
+    const char *name /**< [in] the zone's name, nullptr to not record it */) {
+  auto &buffer = current_buffer();
+  if (buffer.opened < open_zones_max) {
+    buffer.open[buffer.opened] = zone_event{name, now(), 0};
+  }
+  // Past the limit we still count, so `end` stays balanced
+  buffer.opened++;
+}
+
+void profiler::end() {
+  auto &buffer = current_buffer();
+  if (buffer.opened == 0) {
+    console::log(console::priority::warning,
+                 "Profiler zone closed without being opened.\n"_literal);
+    return;
+  }
+  buffer.opened--;
+  if (buffer.opened < open_zones_max &&
+      buffer.open[buffer.opened].name != nullptr && enabled()) {
+    auto &opened = buffer.open[buffer.opened];
+    record(opened.name, opened.start, now());
+  }
+}
+
+const char *profiler::intern(std::string_view name /**< [in] the name */) {
+  auto lock = std::lock_guard<std::mutex>{buffers_mutex};
+  return names.emplace(name).first->c_str();
+}
+
+/// Write a JSON string, escaping what has to be escaped
+static void write_json_string(FILE *file, const char *str) {
+  std::fputc('"', file);
+  for (; *str != '\0'; str++) {
+    auto c = static_cast<unsigned char>(*str);
+    if (c == '"' || c == '\\') {
+      std::fputc('\\', file);
+      std::fputc(c, file);
+    } else if (c < 0x20) {
+      std::fprintf(file, "\\u%04x", c);
+    } else {
+      std::fputc(c, file);
+    }
+  }
+  std::fputc('"', file);
+}
+
+void profiler::deinit() {
+  if (!is_enabled.exchange(false)) {
+    return;
+  }
+  auto file = std::fopen(trace_path.string().c_str(), "w");
+  if (file == nullptr) {
+    console::log(console::priority::error,
+                 "Couldn't write profiler trace '"_literal, trace_path.string(),
+                 "'.\n"_literal);
+    return;
+  }
+
+  auto lock = std::lock_guard<std::mutex>{buffers_mutex};
+  // Timestamps are relative to the earliest zone, in microseconds
+  auto epoch = std::numeric_limits<U64>::max();
+  for (auto &&buffer : buffers) {
+    for (auto i = std::size_t{0}; i < buffer->chunks.size(); i++) {
+      auto &chunk = *buffer->chunks[i];
+      auto used =
+          i + 1 == buffer->chunks.size() ? buffer->used : chunk_events;
+      for (auto j = std::size_t{0}; j < used; j++) {
+        epoch = std::min(epoch, chunk[j].start);
+      }
+    }
+  }
+
+  auto zones = U64{0};
+  auto dropped = U64{0};
+  std::fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  auto separator = "";
+  for (auto &&buffer : buffers) {
+    std::fprintf(file,
+                 "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                 "\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                 separator, buffer->thread_id, buffer->thread_id);
+    separator = ",";
+    for (auto i = std::size_t{0}; i < buffer->chunks.size(); i++) {
+      auto &chunk = *buffer->chunks[i];
+      auto used =
+          i + 1 == buffer->chunks.size() ? buffer->used : chunk_events;
+      for (auto j = std::size_t{0}; j < used; j++) {
+        auto &event = chunk[j];
+        std::fprintf(file, ",\n{\"name\":");
+        write_json_string(file, event.name);
+        std::fprintf(file,
+                     ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                     "\"dur\":%.3f}",
+                     buffer->thread_id, (event.start - epoch) / 1000.0,
+                     (event.end - event.start) / 1000.0);
+      }
+      zones += used;
+    }
+    dropped += buffer->dropped;
+  }
+  std::fprintf(file, "\n]}\n");
+  std::fclose(file);
+
+  console::log(console::priority::notice, "Wrote "_literal, zones,
+               " profiler zones to '"_literal, trace_path.string(),
+               "', dropped "_literal, dropped, ".\n"_literal);
+}
@@ -15,17 +15,221 @@
 // limitations under the License.
 #include "../include/celerygame_runloop.hpp"
 #include "../include/celerygame_console.hpp"
+#include "../include/celerygame_jobs.hpp"
+#include "../include/celerygame_profiler.hpp"
 using namespace celerygame;
 
-static auto all_tasks = std::unique_ptr<runloop::tasks_t>{nullptr};
+using frame_clock = std::chrono::steady_clock;
+
+static auto current_schedule = runloop::schedule{};
+static auto current_frame = runloop::frame{};
+// Simulation time not yet stepped through
+static auto accumulator = frame_clock::duration{0};
+static auto last_tick = frame_clock::time_point{};
+static auto next_deadline = frame_clock::time_point{};
+// Pacing error since the last measurement
+static auto jitter_frames = U64{0};
+static auto jitter_total = F64{0.0};
+static auto jitter_max = F64{0.0};
+
+/// Dense index of a task that's waiting for the tick to finish to be added
+static constexpr auto staged = std::numeric_limits<U32>::max();
+
+/// What every frame reads of a task, kept small so a phase streams through it
+struct entry {
+  runloop::function_t function;
+  void *context;
+  runloop::affinity where;
+};
+
+/// Performs each task's rolling stats are taken over
+static constexpr auto timing_window = std::size_t{64};
+
+/// Rolling timings of a task. Only the thread performing the task writes the
+/// atomics, they're atomic so stats can be read in the middle of a phase.
+struct timing {
+  std::array<std::atomic<U32>, timing_window> samples{}; ///< Nanoseconds
+  std::atomic<U64> performs{0};
+  std::atomic<U64> frame{0};  ///< Nanoseconds taken in `counted`
+  std::atomic<U64> counted{0}; ///< The frame `frame` adds up
+  // Only the main thread touches these
+  F64 budget = 0.0;
+  U64 overruns = 0;
+  U64 unreported = 0; ///< Overruns since the last warning
+  frame_clock::time_point warned{};
+
+  timing() = default;
+  timing(const timing &other) { *this = other; }
+  timing &operator=(const timing &other) {
+    for (auto i = std::size_t{0}; i < timing_window; i++) {
+      samples[i].store(other.samples[i].load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+    }
+    performs.store(other.performs.load(std::memory_order_relaxed),
+                   std::memory_order_relaxed);
+    frame.store(other.frame.load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+    counted.store(other.counted.load(std::memory_order_relaxed),
+                  std::memory_order_relaxed);
+    budget = other.budget;
+    overruns = other.overruns;
+    unreported = other.unreported;
+    warned = other.warned;
+    return *this;
+  }
+
+  /// Add a perform's duration, called by the performing thread. The first
+  /// perform in a frame starts that frame's total over.
+  void add(frame_clock::duration elapsed, U64 number) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                  .count();
+    auto sample = static_cast<U32>(
+        std::min<S64>(ns, std::numeric_limits<U32>::max()));
+    auto n = performs.load(std::memory_order_relaxed);
+    samples[n % timing_window].store(sample, std::memory_order_relaxed);
+    performs.store(n + 1, std::memory_order_relaxed);
+    auto total = counted.load(std::memory_order_relaxed) == number
+                     ? frame.load(std::memory_order_relaxed)
+                     : U64{0};
+    frame.store(total + sample, std::memory_order_relaxed);
+    counted.store(number, std::memory_order_relaxed);
+  }
+};
+
+/// Tasks without dependencies run in batches this big, to amortize the jobs
+static constexpr auto batch_size = U32{64};
+
+/// A job performing a range of a phase's tasks with the same affinity. With
+/// dependencies in the phase, each task gets its own node at its own index.
+struct node {
+  jobs::job job;
+  struct phase_tasks *owner;
+  U32 begin;
+  U32 end;
+  runloop::affinity where;
+};
+
+/// A phase's tasks, stored contiguously and indexed alike
+struct phase_tasks {
+  std::vector<entry> entries;
+  std::vector<U32> slots;                            ///< Registry slot
+  std::vector<std::unique_ptr<runloop::task>> owned; ///< nullptr if function
+  std::vector<U8> quit; ///< Set when the task asked to be deleted
+  std::vector<timing> timings;
+
+  // The dependency graph, rebuilt when tasks or dependencies change
+  bool dirty = true;
+  bool has_edges = false;
+  std::vector<U32> indegree;
+  std::vector<U32> dependents_begin; ///< Into `dependents`, one past per task
+  std::vector<U32> dependents;
+  std::vector<node> nodes;
+  std::unique_ptr<std::atomic<U32>[]> pending;
+  std::size_t pending_size = 0;
+};
+
+/// Where a handle's task lives
+struct slot {
+  U32 generation = 1; ///< Generation 0 is never handed out
+  runloop::phase when;
+  U32 dense = staged;
+  bool live = false;
+  runloop::task *object = nullptr;
+  const char *name = nullptr;
+  std::vector<runloop::handle> after; ///< Tasks that have to finish first
+};
+
+static auto phases = std::array<phase_tasks, 4>{};
+static auto slots = std::vector<slot>{};
+static auto free_slots = std::vector<U32>{};
+static auto is_ticking = std::atomic<bool>{false};
+// Added during a tick, moved into their phases once it finishes
+struct staged_task {
+  U32 slot;
+  entry task;
+  std::unique_ptr<runloop::task> owned;
+};
+static auto staged_tasks = std::vector<staged_task>{};
+// Removed with `remove`, deleted once the tick finishes
+static auto removals_mutex = std::mutex{};
+static auto removals = std::vector<runloop::handle>{};
+
+static auto remaining = std::atomic<std::size_t>{0};
+// The first exception thrown by a task this phase, rethrown on the main thread
+static auto failure_mutex = std::mutex{};
+static auto failure = std::exception_ptr{nullptr};
+// Tasks with a budget, so frames without any skip checking them
+static auto budgeted = std::size_t{0};
+static auto last_report = frame_clock::time_point{};
+
+/// Bits of the millisecond clock each level of the timer wheel covers
+static constexpr auto wheel_bits = U32{8};
+static constexpr auto wheel_slots = U32{1} << wheel_bits;
+static constexpr auto wheel_levels = U32{4};
+/// Ends a wheel slot's list of timers
+static constexpr auto no_timer = std::numeric_limits<U32>::max();
+
+/// A timer in the pool, linked into one of the wheel's slots while pending
+struct timer_node {
+  runloop::timer_function_t function = nullptr;
+  void *context = nullptr;
+  U64 deadline = 0; ///< On the wheel's millisecond clock
+  U64 period = 0;   ///< In milliseconds, 0 for one-shot timers
+  U32 generation = 1;
+  U32 slot = no_timer; ///< The wheel slot it's in, no_timer if not pending
+  U32 prev = no_timer;
+  U32 next = no_timer;
+};
+
+static auto timer_nodes = std::vector<timer_node>{};
+static auto free_timers = std::vector<U32>{};
+// Heads of each slot's list, the lowest level first
+static auto wheel = std::array<U32, wheel_slots * wheel_levels>{};
+// Which lowest level slots hold timers, so empty stretches get skipped
+static auto wheel_occupied = std::array<U64, wheel_slots / 64>{};
+static auto wheel_now = U64{0};
+static auto wheel_epoch = frame_clock::time_point{};
+static auto timers_pending = std::size_t{0};
+
+// Coroutine frames come from free lists of these size classes, bigger ones
+// from the heap
+static constexpr auto frame_granularity = std::size_t{64};
+static constexpr auto frame_classes = std::size_t{64};
+static constexpr auto frame_chunk = std::size_t{64 * 1024};
+static auto frame_free = std::array<void *, frame_classes>{};
+static auto frame_chunks = std::vector<std::unique_ptr<std::byte[]>>{};
+
+// Spawned coroutines, and the ones waiting to resume
+static auto coroutines =
+    static_cast<runloop::coroutine::promise_type *>(nullptr);
+static auto coroutines_running = std::size_t{0};
+static auto resume_next_tick = std::vector<runloop::coroutine::handle_t>{};
+static auto resuming = std::vector<runloop::coroutine::handle_t>{};
+// Coroutines whose jobs ran, queued by the job workers
+static auto jobs_done_mutex = std::mutex{};
+static auto jobs_done = std::vector<runloop::coroutine::handle_t>{};
+static auto jobs_awaited = std::atomic<std::size_t>{0};
+
+// Idling waits for events until something reports activity
+static auto awake_requested = std::atomic<bool>{false};
+static auto is_idling = std::atomic<bool>{false};
+static auto last_activity = frame_clock::time_point{};
+static auto wake_event = std::numeric_limits<U32>::max();
+
+// SDL events are pumped once per tick, every task reads the same buffer
+static constexpr auto events_reserved = std::size_t{256};
+static auto frame_events = std::vector<runloop::event>{};
+
+runloop::task::task(phase p /**< [in] when this task runs in a frame */,
+                    affinity a /**< [in] which threads may perform it */)
+    : _phase{p}, _affinity{a} {}
 
 /// Stub for task deletion calls.
 runloop::task::~task() {}
 
-void runloop::task::perform() {
-  SDL_Event event;
-  while (SDL_PollEvent(&event)) {
-    if (event.type == SDL_QUIT) {
+void runloop::task::perform(const frame &current) {
+  for (auto &&e : events()) {
+    if (e.type == SDL_QUIT) {
       _shall_quit = true;
       return;
     }
@@ -34,36 +238,1218 @@ void runloop::task::perform() {
 
 bool runloop::task::should_quit() const { return _shall_quit; }
 
+runloop::phase runloop::task::when() const { return _phase; }
+
+runloop::affinity runloop::task::where() const { return _affinity; }
+
+/// Perform a task object, the run loop only deals in plain functions
+static bool perform_task(void *context, const runloop::frame &current) {
+  auto object = static_cast<runloop::task *>(context);
+  object->perform(current);
+  return object->should_quit();
+}
+
+/// Get a handle's slot, nullptr if its task is gone
+static slot *find_slot(runloop::handle h) {
+  if (h.index >= slots.size() || slots[h.index].generation != h.generation ||
+      !slots[h.index].live) {
+    return nullptr;
+  }
+  return &slots[h.index];
+}
+
+/// Put a task in its phase's arrays
+static void insert(U32 index, entry task,
+                   std::unique_ptr<runloop::task> &&owned) {
+  auto &tasks = phases[static_cast<std::size_t>(slots[index].when)];
+  slots[index].dense = static_cast<U32>(tasks.entries.size());
+  tasks.entries.emplace_back(task);
+  tasks.slots.emplace_back(index);
+  tasks.owned.emplace_back(std::move(owned));
+  tasks.quit.emplace_back(0);
+  tasks.timings.emplace_back();
+  tasks.dirty = true;
+}
+
+/// Take a task out of its phase by moving the last one into its place
+static void erase(phase_tasks &tasks, U32 dense) {
+  auto &removed = slots[tasks.slots[dense]];
+  removed.generation++;
+  removed.live = false;
+  removed.dense = staged;
+  removed.object = nullptr;
+  removed.after.clear();
+  free_slots.emplace_back(tasks.slots[dense]);
+  if (tasks.timings[dense].budget > 0.0) {
+    budgeted--;
+  }
+
+  auto last = static_cast<U32>(tasks.entries.size() - 1);
+  if (dense != last) {
+    tasks.entries[dense] = tasks.entries[last];
+    tasks.slots[dense] = tasks.slots[last];
+    tasks.owned[dense] = std::move(tasks.owned[last]);
+    tasks.quit[dense] = tasks.quit[last];
+    tasks.timings[dense] = tasks.timings[last];
+    slots[tasks.slots[dense]].dense = dense;
+  }
+  tasks.entries.pop_back();
+  tasks.slots.pop_back();
+  tasks.owned.pop_back();
+  tasks.quit.pop_back();
+  tasks.timings.pop_back();
+  tasks.dirty = true;
+}
+
+/// Register a task, placing it now or after the tick
+static runloop::handle add_entry(runloop::phase p, entry task,
+                                 std::unique_ptr<runloop::task> &&owned,
+                                 const char *name) {
+  auto index = U32{0};
+  if (free_slots.empty()) {
+    index = static_cast<U32>(slots.size());
+    slots.emplace_back();
+  } else {
+    index = free_slots.back();
+    free_slots.pop_back();
+  }
+  auto &added = slots[index];
+  added.when = p;
+  added.live = true;
+  added.object = owned.get();
+  added.name = name;
+  if (is_ticking.load(std::memory_order_acquire)) {
+    staged_tasks.emplace_back(staged_task{index, task, std::move(owned)});
+  } else {
+    insert(index, task, std::move(owned));
+  }
+  return runloop::handle{index, added.generation};
+}
+
+/// Delete removed and quitting tasks, then add staged ones
+static void settle() {
+  {
+    auto lock = std::lock_guard<std::mutex>{removals_mutex};
+    for (auto &&h : removals) {
+      if (auto found = find_slot(h); found != nullptr) {
+        if (found->dense != staged) {
+          phases[static_cast<std::size_t>(found->when)].quit[found->dense] = 1;
+        } else {
+          // Never made it into its phase
+          found->live = false;
+        }
+      }
+    }
+    removals.clear();
+  }
+  for (auto &&tasks : phases) {
+    // Backwards, so whatever gets swapped in was already looked at
+    for (auto i = tasks.entries.size(); i > 0; i--) {
+      if (tasks.quit[i - 1]) {
+        erase(tasks, static_cast<U32>(i - 1));
+      }
+    }
+  }
+  for (auto &&added : staged_tasks) {
+    if (slots[added.slot].live) {
+      insert(added.slot, added.task, std::move(added.owned));
+    } else {
+      slots[added.slot].generation++;
+      slots[added.slot].object = nullptr;
+      slots[added.slot].after.clear();
+      free_slots.emplace_back(added.slot);
+    }
+  }
+  staged_tasks.clear();
+}
+
 void runloop::init() {
-  console::log(console::priority::notice, "Starting run loop.\n");
-  all_tasks = std::make_unique<runloop::tasks_t>();
+  console::log(console::channel::runloop, console::priority::notice,
+               "Starting run loop.\n"_literal);
+  current_frame = frame{};
+  accumulator = frame_clock::duration{0};
+  last_tick = frame_clock::now();
+  next_deadline = last_tick;
+  last_report = last_tick;
+  last_activity = last_tick;
+  measure_jitter();
+  wake_event = SDL_RegisterEvents(1);
+  frame_events.clear();
+  frame_events.reserve(events_reserved);
+
+  timer_nodes.clear();
+  free_timers.clear();
+  wheel.fill(no_timer);
+  wheel_occupied.fill(0);
+  wheel_now = 0;
+  wheel_epoch = last_tick;
+  timers_pending = 0;
 }
 
-runloop::tasks_t *const runloop::tasks() { return all_tasks.get(); }
+runloop::handle
+runloop::add(std::unique_ptr<task> &&added /**< [in] the task to own */,
+             const char *name /**< [in] the task's name in stats */) {
+  auto p = added->when();
+  auto task = entry{perform_task, added.get(), added->where()};
+  return add_entry(p, task, std::move(added), name);
+}
 
-bool runloop::tick() {
-  if (all_tasks == nullptr) {
+runloop::handle
+runloop::add(phase p /**< [in] when the function runs in a frame */,
+             function_t function /**< [in] the task's function */,
+             void *context /**< [in] passed to the function */,
+             affinity a /**< [in] which threads may call the function */,
+             const char *name /**< [in] the task's name in stats */) {
+  return add_entry(p, entry{function, context, a}, nullptr, name);
+}
+
+void runloop::remove(handle h /**< [in] the task to delete */) {
+  {
+    auto lock = std::lock_guard<std::mutex>{removals_mutex};
+    removals.emplace_back(h);
+  }
+  if (!is_ticking.load(std::memory_order_acquire)) {
+    settle();
+  }
+}
+
+bool runloop::contains(handle h /**< [in] the task */) {
+  return find_slot(h) != nullptr;
+}
+
+runloop::task *runloop::get(handle h /**< [in] the task */) {
+  auto found = find_slot(h);
+  return found != nullptr ? found->object : nullptr;
+}
+
+/// Does `from` depend on `to`, directly or not?
+static bool reaches(runloop::handle from, runloop::handle to) {
+  if (from == to) {
+    return true;
+  }
+  auto found = find_slot(from);
+  if (found == nullptr) {
+    return false;
+  }
+  for (auto &&dependency : found->after) {
+    if (reaches(dependency, to)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void runloop::depends_on(handle h /**< [in] the task that waits */,
+                         handle other /**< [in] the task to finish first */) {
+  auto waits = find_slot(h);
+  auto first = find_slot(other);
+  if (waits == nullptr || first == nullptr) {
+    throw std::runtime_error{"Can't add a dependency on a deleted task."};
+  }
+  if (first->when > waits->when) {
+    throw std::runtime_error{
+        "A task can't depend on a task from a later phase."};
+  }
+  if (reaches(other, h)) {
+    throw std::runtime_error{"Task dependencies can't form a cycle."};
+  }
+  waits->after.emplace_back(other);
+  phases[static_cast<std::size_t>(waits->when)].dirty = true;
+}
+
+std::size_t runloop::count() {
+  auto total = staged_tasks.size();
+  for (auto &&tasks : phases) {
+    total += tasks.entries.size();
+  }
+  return total;
+}
+
+void runloop::set_budget(handle h /**< [in] the task */,
+                         F64 seconds /**< [in] its budget, 0 is unlimited */) {
+  auto found = find_slot(h);
+  if (found == nullptr || found->dense == staged) {
+    throw std::runtime_error{
+        "Can only budget tasks that have started running."};
+  }
+  auto &measured =
+      phases[static_cast<std::size_t>(found->when)].timings[found->dense];
+  if ((measured.budget > 0.0) != (seconds > 0.0)) {
+    seconds > 0.0 ? budgeted++ : budgeted--;
+  }
+  measured.budget = std::max(seconds, 0.0);
+}
+
+/// Work out a task's stats from its timings
+static runloop::task_stats measure(U32 index, const timing &measured) {
+  auto &found = slots[index];
+  auto performs = measured.performs.load(std::memory_order_relaxed);
+  auto stats = runloop::task_stats{};
+  stats.task = runloop::handle{index, found.generation};
+  stats.name = found.name;
+  stats.when = found.when;
+  stats.performs = performs;
+  stats.budget = measured.budget;
+  stats.overruns = measured.overruns;
+  auto window = std::array<U32, timing_window>{};
+  auto size = static_cast<std::size_t>(
+      std::min<U64>(performs, timing_window));
+  if (size == 0) {
+    return stats;
+  }
+  for (auto i = std::size_t{0}; i < size; i++) {
+    window[i] = measured.samples[i].load(std::memory_order_relaxed);
+  }
+  std::sort(window.begin(), window.begin() + size);
+  auto percentile = [&](F64 q) {
+    return window[std::min(size - 1, static_cast<std::size_t>(q * size))] /
+           1e9;
+  };
+  stats.p50 = percentile(0.50);
+  stats.p95 = percentile(0.95);
+  stats.p99 = percentile(0.99);
+  stats.max = window[size - 1] / 1e9;
+  return stats;
+}
+
+runloop::task_stats runloop::stats(handle h /**< [in] the task */) {
+  auto found = find_slot(h);
+  if (found == nullptr) {
+    throw std::runtime_error{"Can't get the stats of a deleted task."};
+  }
+  if (found->dense == staged) {
+    return measure(h.index, timing{});
+  }
+  return measure(
+      h.index,
+      phases[static_cast<std::size_t>(found->when)].timings[found->dense]);
+}
+
+std::vector<runloop::task_stats> runloop::all_stats() {
+  auto all = std::vector<task_stats>{};
+  for (auto &&tasks : phases) {
+    for (auto i = std::size_t{0}; i < tasks.entries.size(); i++) {
+      all.emplace_back(measure(tasks.slots[i], tasks.timings[i]));
+    }
+  }
+  return all;
+}
+
+void runloop::report() {
+  auto all = all_stats();
+  auto us = [](F64 seconds) { return static_cast<U64>(seconds * 1e6); };
+  console::log(console::channel::runloop, console::priority::informational,
+               "Task stats over the last "_literal, timing_window,
+               " performs, in us (p50/p95/p99/max):\n"_literal);
+  for (auto &&stats : all) {
+    console::log(console::channel::runloop, console::priority::informational,
+                 "  "_literal, phase_name(stats.when), " '"_literal, stats.name,
+                 "': "_literal, us(stats.p50), " / "_literal, us(stats.p95),
+                 " / "_literal, us(stats.p99), " / "_literal, us(stats.max),
+                 ", "_literal, stats.performs, " performs, "_literal,
+                 stats.overruns, " overruns.\n"_literal);
+  }
+}
+
+const char *runloop::phase_name(phase p /**< [in] the phase */) {
+  switch (p) {
+  case phase::input:
+    return "input";
+  case phase::simulate:
+    return "simulate";
+  case phase::render:
+    return "render";
+  case phase::present:
+    return "present";
+  }
+  return "unknown";
+}
+
+void runloop::set_schedule(
+    const schedule &next /**< [in] how to pace frames from now on */) {
+  if (next.simulation_rate <= 0.0 || next.max_steps == 0) {
+    throw std::runtime_error{"The run loop has to simulate something."};
+  }
+  current_schedule = next;
+}
+
+const runloop::schedule &runloop::get_schedule() { return current_schedule; }
+
+runloop::jitter runloop::measure_jitter() {
+  auto measured = jitter{jitter_frames,
+                         jitter_frames > 0 ? jitter_total / jitter_frames : 0.0,
+                         jitter_max};
+  jitter_frames = 0;
+  jitter_total = 0.0;
+  jitter_max = 0.0;
+  return measured;
+}
+
+/// Perform one of a phase's tasks, timing it if asked to
+static void perform_entry(phase_tasks &tasks, std::size_t i) {
+  auto &task = tasks.entries[i];
+  if (!current_schedule.measure_tasks) {
+    if (task.function(task.context, current_frame)) {
+      tasks.quit[i] = 1;
+    }
+    return;
+  }
+  auto start = frame_clock::now();
+  auto quits = task.function(task.context, current_frame);
+  tasks.timings[i].add(frame_clock::now() - start, current_frame.number);
+  if (quits) {
+    tasks.quit[i] = 1;
+  }
+}
+
+/// Queue a task of the running phase on the job system
+static void schedule_node(node &ready) {
+  if (ready.where == runloop::affinity::main_thread) {
+    jobs::push_main(&ready.job);
+  } else {
+    jobs::push(&ready.job);
+  }
+}
+
+/// Perform a node's tasks as a job, then release the tasks waiting on them
+static void perform_node(void *context) {
+  auto &current = *static_cast<node *>(context);
+  auto &tasks = *current.owner;
+  for (auto i = current.begin; i < current.end; i++) {
+    auto &task = tasks.entries[i];
+    if (task.where != current.where || tasks.quit[i]) {
+      continue;
+    }
+    try {
+      perform_entry(tasks, i);
+    } catch (...) {
+      auto lock = std::lock_guard<std::mutex>{failure_mutex};
+      if (failure == nullptr) {
+        failure = std::current_exception();
+      }
+    }
+  }
+  if (!tasks.has_edges) {
+    remaining.fetch_sub(1, std::memory_order_acq_rel);
+    return;
+  }
+  for (auto i = tasks.dependents_begin[current.begin];
+       i < tasks.dependents_begin[current.begin + 1]; i++) {
+    auto dependent = tasks.dependents[i];
+    if (tasks.pending[dependent].fetch_sub(1, std::memory_order_acq_rel) ==
+        1) {
+      schedule_node(tasks.nodes[dependent]);
+    }
+  }
+  remaining.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+/// Rebuild the dependency graph of a phase's tasks
+static void build_phase(phase_tasks &tasks) {
+  auto size = tasks.entries.size();
+  tasks.indegree.assign(size, 0);
+  tasks.dependents_begin.assign(size + 1, 0);
+  tasks.dependents.clear();
+  tasks.has_edges = false;
+  // Dependencies on earlier phases have already finished
+  auto same_phase = [&](runloop::handle h) -> slot * {
+    auto found = find_slot(h);
+    if (found == nullptr || found->dense == staged ||
+        &phases[static_cast<std::size_t>(found->when)] != &tasks) {
+      return nullptr;
+    }
+    return found;
+  };
+  for (auto i = U32{0}; i < size; i++) {
+    for (auto &&dependency : slots[tasks.slots[i]].after) {
+      if (auto first = same_phase(dependency); first != nullptr) {
+        tasks.dependents_begin[first->dense + 1]++;
+        tasks.indegree[i]++;
+        tasks.has_edges = true;
+      }
+    }
+  }
+  std::partial_sum(tasks.dependents_begin.begin(),
+                   tasks.dependents_begin.end(),
+                   tasks.dependents_begin.begin());
+  tasks.dependents.resize(tasks.dependents_begin[size]);
+  auto filled = std::vector<U32>{tasks.dependents_begin.begin(),
+                                 tasks.dependents_begin.end() - 1};
+  for (auto i = U32{0}; i < size; i++) {
+    for (auto &&dependency : slots[tasks.slots[i]].after) {
+      if (auto first = same_phase(dependency); first != nullptr) {
+        tasks.dependents[filled[first->dense]++] = i;
+      }
+    }
+  }
+
+  tasks.nodes.clear();
+  if (tasks.has_edges) {
+    for (auto i = U32{0}; i < size; i++) {
+      tasks.nodes.emplace_back(
+          node{jobs::job{perform_node, nullptr}, &tasks, i, i + 1,
+               tasks.entries[i].where});
+    }
+  } else {
+    for (auto begin = U32{0}; begin < size; begin += batch_size) {
+      auto end = std::min(begin + batch_size, static_cast<U32>(size));
+      for (auto where :
+           {runloop::affinity::any, runloop::affinity::main_thread}) {
+        if (std::any_of(tasks.entries.begin() + begin,
+                        tasks.entries.begin() + end,
+                        [&](auto &&task) { return task.where == where; })) {
+          tasks.nodes.emplace_back(node{jobs::job{perform_node, nullptr},
+                                        &tasks, begin, end, where});
+        }
+      }
+    }
+  }
+  for (auto &&current : tasks.nodes) {
+    current.job.context = &current;
+  }
+  if (tasks.pending_size < size) {
+    tasks.pending = std::make_unique<std::atomic<U32>[]>(size);
+    tasks.pending_size = size;
+  }
+  tasks.dirty = false;
+}
+
+/// Perform a phase's tasks once, returning when every task finished
+static void perform_phase(runloop::phase p) {
+  auto &tasks = phases[static_cast<std::size_t>(p)];
+  if (tasks.entries.empty()) {
+    return;
+  }
+  if (tasks.dirty) {
+    build_phase(tasks);
+  }
+  // Nothing to run in parallel or in order, just stream through the phase
+  if (!tasks.has_edges && jobs::workers() == 0) {
+    for (auto i = std::size_t{0}; i < tasks.entries.size(); i++) {
+      if (!tasks.quit[i]) {
+        perform_entry(tasks, i);
+      }
+    }
+    return;
+  }
+
+  remaining.store(tasks.nodes.size(), std::memory_order_relaxed);
+  if (tasks.has_edges) {
+    for (auto i = std::size_t{0}; i < tasks.nodes.size(); i++) {
+      tasks.pending[i].store(tasks.indegree[i], std::memory_order_relaxed);
+    }
+  }
+  for (auto i = std::size_t{0}; i < tasks.nodes.size(); i++) {
+    if (!tasks.has_edges || tasks.indegree[i] == 0) {
+      schedule_node(tasks.nodes[i]);
+    }
+  }
+  // Help out while waiting, main thread only tasks can only run here
+  while (remaining.load(std::memory_order_acquire) > 0) {
+    if (!jobs::run_one()) {
+      std::this_thread::yield();
+    }
+  }
+  if (failure != nullptr) {
+    auto rethrown = failure;
+    failure = nullptr;
+    std::rethrow_exception(rethrown);
+  }
+}
+
+/// Put a timer in the slot its deadline falls in, no earlier than `earliest`
+static void link_timer(U32 index, U64 earliest) {
+  auto &node = timer_nodes[index];
+  auto deadline = std::max(node.deadline, earliest);
+  auto level = U32{0};
+  while (level + 1 < wheel_levels &&
+         deadline - wheel_now >= U64{1} << (wheel_bits * (level + 1))) {
+    level++;
+  }
+  // Past what the wheel covers, it's cascaded back up until it's due
+  deadline = std::min(deadline,
+                      wheel_now + (U64{1} << (wheel_bits * wheel_levels)) - 1);
+  auto slot = level * wheel_slots +
+              static_cast<U32>((deadline >> (wheel_bits * level)) &
+                               (wheel_slots - 1));
+  node.slot = slot;
+  node.prev = no_timer;
+  node.next = wheel[slot];
+  if (node.next != no_timer) {
+    timer_nodes[node.next].prev = index;
+  }
+  wheel[slot] = index;
+  if (level == 0) {
+    wheel_occupied[slot / 64] |= U64{1} << (slot % 64);
+  }
+}
+
+/// Take a timer out of its slot
+static void unlink_timer(U32 index) {
+  auto &node = timer_nodes[index];
+  if (node.prev != no_timer) {
+    timer_nodes[node.prev].next = node.next;
+  } else {
+    wheel[node.slot] = node.next;
+    if (node.next == no_timer && node.slot < wheel_slots) {
+      wheel_occupied[node.slot / 64] &= ~(U64{1} << (node.slot % 64));
+    }
+  }
+  if (node.next != no_timer) {
+    timer_nodes[node.next].prev = node.prev;
+  }
+  node.slot = no_timer;
+}
+
+/// Return a timer to the pool
+static void free_timer(U32 index) {
+  timer_nodes[index].generation++;
+  free_timers.emplace_back(index);
+  timers_pending--;
+}
+
+/// Move the timers in a level's current slot down to the levels below
+static void cascade(U32 level) {
+  auto slot = level * wheel_slots +
+              static_cast<U32>((wheel_now >> (wheel_bits * level)) &
+                               (wheel_slots - 1));
+  auto index = wheel[slot];
+  wheel[slot] = no_timer;
+  // Cascades run before the current lowest level slot fires, so timers due
+  // right now still make it into that slot
+  while (index != no_timer) {
+    auto next = timer_nodes[index].next;
+    link_timer(index, wheel_now);
+    index = next;
+  }
+}
+
+/// Advance the wheel a millisecond, firing what's due
+static void step_timers(U64 target) {
+  wheel_now++;
+  for (auto level = U32{1}; level < wheel_levels; level++) {
+    if ((wheel_now & ((U64{1} << (wheel_bits * level)) - 1)) != 0) {
+      break;
+    }
+    cascade(level);
+  }
+  auto slot = static_cast<U32>(wheel_now & (wheel_slots - 1));
+  // Callbacks can't add timers to this slot, they're due a millisecond later
+  // at the earliest
+  while (wheel[slot] != no_timer) {
+    auto index = wheel[slot];
+    unlink_timer(index);
+    auto &node = timer_nodes[index];
+    auto function = node.function;
+    auto context = node.context;
+    if (node.period > 0) {
+      node.deadline += node.period;
+      // Fell behind, catch up once rather than for every missed period
+      if (node.deadline <= target) {
+        node.deadline = target;
+      }
+      link_timer(index, wheel_now + 1);
+    } else {
+      free_timer(index);
+    }
+    function(context);
+  }
+}
+
+/// The first millisecond in [from, to) whose lowest level slot holds timers,
+/// or `to`. Both have to be in the same turn of the lowest level.
+static U64 next_occupied(U64 from, U64 to) {
+  auto base = from & ~U64{wheel_slots - 1};
+  for (auto i = from - base; i < to - base;) {
+    auto word = wheel_occupied[i / 64] >> (i % 64);
+    if (word == 0) {
+      i = (i / 64 + 1) * 64;
+      continue;
+    }
+    while ((word & 1) == 0) {
+      word >>= 1;
+      i++;
+    }
+    return std::min(base + i, to);
+  }
+  return to;
+}
+
+/// Fire every timer due by now, skipping stretches where nothing's due
+static void advance_timers(frame_clock::time_point now) {
+  auto target = static_cast<U64>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(now - wheel_epoch)
+          .count());
+  while (wheel_now < target) {
+    if (timers_pending == 0) {
+      wheel_now = target;
+      return;
+    }
+    // Cascades happen when the lowest level wraps around, stop there
+    auto wrap = (wheel_now | (wheel_slots - 1)) + 1;
+    auto due = next_occupied(wheel_now + 1, std::min(target, wrap));
+    wheel_now = due - 1;
+    step_timers(target);
+  }
+}
+
+runloop::timer
+runloop::start_timer(F64 delay /**< [in] seconds until it's first called */,
+                     F64 period /**< [in] seconds between calls, 0 for once */,
+                     timer_function_t function /**< [in] what to call */,
+                     void *context /**< [in] passed to the function */) {
+  if (function == nullptr || !(delay >= 0.0) || !(period >= 0.0)) {
     throw std::runtime_error{
-        "Tasks must exist. Did you mean to init the tasks infrastructure "
-        "beforehand?"};
+        "A timer needs a function and a delay and period of at least 0."};
   }
-  auto has_no_tasks = all_tasks->empty();
-  if (has_no_tasks) {
-    console::log(console::priority::informational,
-                 "No tasks left to perform.\n");
+  auto index = U32{0};
+  if (free_timers.empty()) {
+    index = static_cast<U32>(timer_nodes.size());
+    timer_nodes.emplace_back();
+  } else {
+    index = free_timers.back();
+    free_timers.pop_back();
+  }
+  auto &node = timer_nodes[index];
+  node.function = function;
+  node.context = context;
+  // The wheel only moves at the start of a tick, count from the actual time
+  auto since = std::chrono::ceil<std::chrono::milliseconds>(
+      frame_clock::now() - wheel_epoch);
+  node.deadline = static_cast<U64>(since.count()) +
+                  static_cast<U64>(std::llround(delay * 1000.0));
+  node.period = static_cast<U64>(std::llround(period * 1000.0));
+  // Periodic timers can't be due in the slot they're firing from
+  if (period > 0.0 && node.period == 0) {
+    node.period = 1;
+  }
+  link_timer(index, wheel_now + 1);
+  timers_pending++;
+  return timer{index, node.generation};
+}
+
+bool runloop::cancel_timer(timer t /**< [in] the timer */) {
+  if (t.index >= timer_nodes.size() ||
+      timer_nodes[t.index].generation != t.generation ||
+      timer_nodes[t.index].slot == no_timer) {
     return false;
   }
+  unlink_timer(t.index);
+  free_timer(t.index);
+  return true;
+}
 
-  // has to be over here, preempt to suppress UB
-  all_tasks->remove_if([](auto &&task) { return task->should_quit(); });
+std::size_t runloop::pending_timers() { return timers_pending; }
 
-  for (auto &&task : *all_tasks) {
-    task->perform();
+void *runloop::allocate_frame(std::size_t size /**< [in] frame size */) {
+  auto size_class = (size + frame_granularity - 1) / frame_granularity;
+  if (size_class == 0 || size_class > frame_classes) {
+    return ::operator new(size);
+  }
+  auto &head = frame_free[size_class - 1];
+  if (head == nullptr) {
+    auto block = size_class * frame_granularity;
+    auto &chunk = frame_chunks.emplace_back(
+        std::make_unique<std::byte[]>(frame_chunk));
+    for (auto offset = frame_chunk / block * block; offset > 0;
+         offset -= block) {
+      auto frame = chunk.get() + offset - block;
+      *reinterpret_cast<void **>(frame) = head;
+      head = frame;
+    }
   }
+  auto frame = head;
+  head = *static_cast<void **>(frame);
+  return frame;
+}
 
+void runloop::free_frame(void *frame /**< [in] from `allocate_frame` */,
+                         std::size_t size /**< [in] frame size */) {
+  auto size_class = (size + frame_granularity - 1) / frame_granularity;
+  if (size_class == 0 || size_class > frame_classes) {
+    ::operator delete(frame);
+    return;
+  }
+  *static_cast<void **>(frame) = frame_free[size_class - 1];
+  frame_free[size_class - 1] = frame;
+}
+
+runloop::coroutine::coroutine(handle_t h /**< [in] the coroutine */)
+    : _handle{h} {}
+
+runloop::coroutine::coroutine(coroutine &&other) noexcept
+    : _handle{std::exchange(other._handle, nullptr)} {}
+
+runloop::coroutine &runloop::coroutine::operator=(coroutine &&other) noexcept {
+  if (this != &other) {
+    if (_handle) {
+      _handle.destroy();
+    }
+    _handle = std::exchange(other._handle, nullptr);
+  }
+  return *this;
+}
+
+runloop::coroutine::~coroutine() {
+  if (_handle) {
+    _handle.destroy();
+  }
+}
+
+runloop::coroutine::handle_t runloop::coroutine::release() {
+  return std::exchange(_handle, nullptr);
+}
+
+/// Resume a spawned coroutine, destroying it once it's finished
+static void resume(runloop::coroutine::handle_t h) {
+  h.resume();
+  if (!h.done()) {
+    return;
+  }
+  auto &promise = h.promise();
+  if (promise.prev != nullptr) {
+    promise.prev->next = promise.next;
+  } else {
+    coroutines = promise.next;
+  }
+  if (promise.next != nullptr) {
+    promise.next->prev = promise.prev;
+  }
+  coroutines_running--;
+  auto failure = promise.failure;
+  h.destroy();
+  if (failure != nullptr) {
+    std::rethrow_exception(failure);
+  }
+}
+
+/// Resume coroutines whose jobs ran and those waiting for this tick
+static void resume_coroutines() {
+  {
+    auto lock = std::lock_guard<std::mutex>{jobs_done_mutex};
+    resuming.swap(jobs_done);
+  }
+  resuming.insert(resuming.end(), resume_next_tick.begin(),
+                  resume_next_tick.end());
+  resume_next_tick.clear();
+  // Anything awaiting the next tick now goes back in `resume_next_tick`
+  for (auto i = std::size_t{0}; i < resuming.size(); i++) {
+    try {
+      resume(resuming[i]);
+    } catch (...) {
+      resume_next_tick.insert(resume_next_tick.end(), resuming.begin() + i + 1,
+                              resuming.end());
+      resuming.clear();
+      throw;
+    }
+  }
+  resuming.clear();
+}
+
+/// Resume a coroutine from a timer
+static void resume_sleeping(void *context) {
+  resume(runloop::coroutine::handle_t::from_address(context));
+}
+
+/// Run an awaited job's work, keeping what it throws for the coroutine
+static void perform_work(runloop::job_awaiter &awaiter) {
+  try {
+    awaiter.work.function(awaiter.work.context);
+  } catch (...) {
+    awaiter.failure = std::current_exception();
+  }
+}
+
+/// Run an awaited job, then queue its coroutine to resume
+static void perform_awaited_job(void *context) {
+  auto &awaiter = *static_cast<runloop::job_awaiter *>(context);
+  perform_work(awaiter);
+  // The coroutine may be resumed and destroyed right after this
+  {
+    auto lock = std::lock_guard<std::mutex>{jobs_done_mutex};
+    jobs_done.emplace_back(awaiter.waiting);
+  }
+  jobs_awaited.fetch_sub(1, std::memory_order_release);
+}
+
+void runloop::spawn(coroutine &&c /**< [in] the coroutine to run */) {
+  auto h = c.release();
+  if (!h) {
+    throw std::runtime_error{"Can't spawn a coroutine that's been moved."};
+  }
+  auto &promise = h.promise();
+  promise.next = coroutines;
+  if (coroutines != nullptr) {
+    coroutines->prev = &promise;
+  }
+  coroutines = &promise;
+  coroutines_running++;
+  resume_next_tick.emplace_back(h);
+}
+
+void runloop::next_tick_awaiter::await_suspend(coroutine::handle_t h) {
+  resume_next_tick.emplace_back(h);
+}
+
+void runloop::sleep_awaiter::await_suspend(coroutine::handle_t h) {
+  start_timer(seconds, 0.0, resume_sleeping, h.address());
+}
+
+bool runloop::job_awaiter::await_suspend(coroutine::handle_t h) {
+  // Nothing else would run it, so run it now and don't wait
+  if (jobs::workers() == 0) {
+    perform_work(*this);
+    return false;
+  }
+  waiting = h;
+  job = jobs::job{perform_awaited_job, this};
+  jobs_awaited.fetch_add(1, std::memory_order_relaxed);
+  jobs::push(&job);
+  return true;
+}
+
+void runloop::job_awaiter::await_resume() {
+  if (failure != nullptr) {
+    std::rethrow_exception(failure);
+  }
+}
+
+runloop::next_tick_awaiter runloop::next_tick() { return {}; }
+
+runloop::sleep_awaiter
+runloop::sleep_for(std::chrono::duration<F64> duration /**< [in] how long */) {
+  return sleep_awaiter{duration.count()};
+}
+
+runloop::job_awaiter runloop::run_job(jobs::job work /**< [in] the job */) {
+  return job_awaiter{work, jobs::job{nullptr, nullptr}, nullptr, nullptr};
+}
+
+std::size_t runloop::running_coroutines() { return coroutines_running; }
+
+/// Take this tick's events off SDL's queue
+static void pump_events() {
+  auto scope = profiler::zone{"runloop::pump_events"};
+  frame_events.clear();
+  auto polled = SDL_Event{};
+  while (SDL_PollEvent(&polled)) {
+    if (polled.type == wake_event) {
+      continue;
+    }
+    auto e = runloop::event{};
+    e.type = polled.type;
+    switch (polled.type) {
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+      e.timestamp = polled.key.timestamp;
+      e.window = polled.key.windowID;
+      e.code = polled.key.keysym.scancode;
+      e.key = polled.key.keysym.sym;
+      e.modifiers = polled.key.keysym.mod;
+      e.state = polled.key.state;
+      e.repeats = polled.key.repeat;
+      break;
+    case SDL_MOUSEMOTION:
+      e.timestamp = polled.motion.timestamp;
+      e.window = polled.motion.windowID;
+      e.x = polled.motion.x;
+      e.y = polled.motion.y;
+      e.dx = polled.motion.xrel;
+      e.dy = polled.motion.yrel;
+      e.state = static_cast<U8>(polled.motion.state);
+      break;
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP:
+      e.timestamp = polled.button.timestamp;
+      e.window = polled.button.windowID;
+      e.code = polled.button.button;
+      e.x = polled.button.x;
+      e.y = polled.button.y;
+      e.state = polled.button.state;
+      e.repeats = polled.button.clicks;
+      break;
+    case SDL_MOUSEWHEEL:
+      e.timestamp = polled.wheel.timestamp;
+      e.window = polled.wheel.windowID;
+      e.x = polled.wheel.x;
+      e.y = polled.wheel.y;
+      break;
+    case SDL_WINDOWEVENT:
+      e.timestamp = polled.window.timestamp;
+      e.window = polled.window.windowID;
+      e.code = polled.window.event;
+      e.x = polled.window.data1;
+      e.y = polled.window.data2;
+      break;
+    default:
+      // Every event starts with its type and timestamp
+      e.timestamp = polled.key.timestamp;
+      break;
+    }
+    frame_events.emplace_back(e);
+  }
+  if (!frame_events.empty()) {
+    awake_requested.store(true, std::memory_order_relaxed);
+  }
+}
+
+const runloop::frame &runloop::current() { return current_frame; }
+
+std::span<const runloop::event> runloop::events() { return frame_events; }
+
+/// When the next timer is due on the wheel's clock, or when a cascade might
+/// make it due. The maximum if no timers are pending.
+static U64 next_timer_due() {
+  if (timers_pending == 0) {
+    return std::numeric_limits<U64>::max();
+  }
+  auto due = std::numeric_limits<U64>::max();
+  for (auto level = U32{0}; level < wheel_levels; level++) {
+    auto shift = wheel_bits * level;
+    auto current = (wheel_now >> shift) & (wheel_slots - 1);
+    for (auto ahead = U64{1}; ahead <= wheel_slots; ahead++) {
+      auto slot = static_cast<U32>((current + ahead) & (wheel_slots - 1));
+      if (wheel[level * wheel_slots + slot] != no_timer) {
+        // The lowest level fires in its slot, the rest cascade at its start
+        auto at = level == 0 ? wheel_now + ahead
+                             : ((wheel_now >> shift) + ahead) << shift;
+        due = std::min(due, at);
+        break;
+      }
+    }
+  }
+  return due;
+}
+
+void runloop::keep_awake() {
+  // Pairs with `idle`, each side stores then loads the other's flag, and only
+  // sequential consistency keeps both from missing the other's store
+  awake_requested.store(true, std::memory_order_seq_cst);
+  if (is_idling.load(std::memory_order_seq_cst) &&
+      wake_event != std::numeric_limits<U32>::max()) {
+    auto event = SDL_Event{};
+    event.type = wake_event;
+    SDL_PushEvent(&event);
+  }
+}
+
+bool runloop::idling() { return is_idling.load(std::memory_order_relaxed); }
+
+/// Should the next frame wait for events instead of being paced?
+static bool should_idle(frame_clock::time_point now) {
+  if (awake_requested.exchange(false, std::memory_order_relaxed)) {
+    last_activity = now;
+  }
+  return current_schedule.idle &&
+         now - last_activity >=
+             std::chrono::duration<F64>{current_schedule.idle_delay} &&
+         resume_next_tick.empty() && staged_tasks.empty() &&
+         jobs_awaited.load(std::memory_order_acquire) == 0;
+}
+
+/// Wait for an event or the next timer, leaving the event to be polled
+static void idle() {
+  auto timeout = -1;
+  if (auto due = next_timer_due();
+      due != std::numeric_limits<U64>::max()) {
+    auto since = std::chrono::duration_cast<std::chrono::milliseconds>(
+        frame_clock::now() - wheel_epoch);
+    auto left = due > static_cast<U64>(since.count())
+                    ? due - static_cast<U64>(since.count())
+                    : U64{0};
+    timeout = static_cast<int>(
+        std::min<U64>(left, std::numeric_limits<int>::max()));
+  }
+  is_idling.store(true, std::memory_order_seq_cst);
+  // Activity reported since we decided to idle would otherwise be missed
+  if (!awake_requested.load(std::memory_order_seq_cst)) {
+    if (timeout < 0) {
+      SDL_WaitEvent(nullptr);
+    } else if (timeout > 0) {
+      SDL_WaitEventTimeout(nullptr, timeout);
+    }
+  }
+  is_idling.store(false, std::memory_order_release);
+  // Idle time isn't simulated, and the next frame starts from now
+  last_tick = frame_clock::now();
+  next_deadline = last_tick;
+}
+
+/// Warn about tasks that went over their budget this frame, at most once a
+/// second per task
+static void check_budgets(frame_clock::time_point now) {
+  // Frame totals start over by themselves, so there's nothing to reset
+  if (budgeted == 0) {
+    return;
+  }
+  for (auto &&tasks : phases) {
+    for (auto i = std::size_t{0}; i < tasks.entries.size(); i++) {
+      auto &measured = tasks.timings[i];
+      // Not performed this frame, what's there is an older frame's
+      if (measured.budget <= 0.0 ||
+          measured.counted.load(std::memory_order_relaxed) !=
+              current_frame.number) {
+        continue;
+      }
+      auto took = measured.frame.load(std::memory_order_relaxed);
+      if (took <= measured.budget * 1e9) {
+        continue;
+      }
+      measured.overruns++;
+      measured.unreported++;
+      if (now - measured.warned < std::chrono::seconds{1}) {
+        continue;
+      }
+      console::log(console::channel::runloop, console::priority::warning,
+                   "Task '"_literal, slots[tasks.slots[i]].name,
+                   "' took "_literal, took / 1000, " us of its "_literal,
+                   static_cast<U64>(measured.budget * 1e6),
+                   " us budget, over budget "_literal, measured.unreported,
+                   " times since last warned.\n"_literal);
+      measured.warned = now;
+      measured.unreported = 0;
+    }
+  }
+}
+
+/// Wait for the next frame's deadline, sleeping first and then spinning
+static void pace() {
+  if (current_schedule.frame_rate <= 0.0) {
+    return;
+  }
+  auto frame_time = std::chrono::duration_cast<frame_clock::duration>(
+      std::chrono::duration<F64>{1.0 / current_schedule.frame_rate});
+  auto spin = std::chrono::duration_cast<frame_clock::duration>(
+      std::chrono::duration<F64>{current_schedule.spin});
+  next_deadline += frame_time;
+
+  auto now = frame_clock::now();
+  // We're more than a frame late, don't try to make the time back up
+  if (now > next_deadline + frame_time) {
+    next_deadline = now;
+    return;
+  }
+  // The OS sleeps coarsely, so only sleep up until close to the deadline...
+  if (next_deadline - now > spin) {
+    std::this_thread::sleep_for(next_deadline - now - spin);
+  }
+  // ...then spin the rest of the way
+  while ((now = frame_clock::now()) < next_deadline) {
+    std::this_thread::yield();
+  }
+
+  auto error = std::chrono::duration<F64>{now - next_deadline}.count();
+  jitter_frames++;
+  jitter_total += error;
+  jitter_max = std::max(jitter_max, error);
+}
+
+F64 runloop::slack() {
+  if (current_schedule.frame_rate <= 0.0) {
+    return std::numeric_limits<F64>::infinity();
+  }
+  // Pacing moves the deadline on after the frame, so it's still the last one
+  auto deadline =
+      next_deadline + std::chrono::duration_cast<frame_clock::duration>(
+                          std::chrono::duration<F64>{
+                              1.0 / current_schedule.frame_rate});
+  return std::max(
+      0.0, std::chrono::duration<F64>{deadline - frame_clock::now()}.count());
+}
+
+bool runloop::tick() {
+  auto scope = profiler::zone{"runloop::tick"};
+  if (count() == 0) {
+    console::log(console::channel::runloop, console::priority::informational,
+                 "No tasks left to perform.\n"_literal);
+    return false;
+  }
+
+  auto now = frame_clock::now();
+  accumulator += now - last_tick;
+  last_tick = now;
+  auto timestep = std::chrono::duration_cast<frame_clock::duration>(
+      std::chrono::duration<F64>{1.0 / current_schedule.simulation_rate});
+  current_frame.timestep = 1.0 / current_schedule.simulation_rate;
+  current_frame.steps = 0;
+
+  is_ticking.store(true, std::memory_order_release);
+  try {
+    pump_events();
+    advance_timers(now);
+    resume_coroutines();
+    perform_phase(phase::input);
+    while (accumulator >= timestep &&
+           current_frame.steps < current_schedule.max_steps) {
+      perform_phase(phase::simulate);
+      accumulator -= timestep;
+      current_frame.steps++;
+    }
+    // Too far behind to catch up, drop the time instead of spiralling
+    if (accumulator >= timestep) {
+      accumulator %= timestep;
+    }
+    current_frame.alpha = std::chrono::duration<F32>{accumulator} /
+                          std::chrono::duration<F32>{timestep};
+    perform_phase(phase::render);
+    perform_phase(phase::present);
+  } catch (...) {
+    is_ticking.store(false, std::memory_order_release);
+    settle();
+    throw;
+  }
+  is_ticking.store(false, std::memory_order_release);
+  if (current_schedule.measure_tasks) {
+    check_budgets(now);
+    if (current_schedule.report_interval > 0.0 &&
+        now - last_report >=
+            std::chrono::duration<F64>{current_schedule.report_interval}) {
+      report();
+      last_report = now;
+    }
+  }
+  settle();
+  current_frame.number++;
+
+  if (should_idle(frame_clock::now())) {
+    idle();
+  } else {
+    pace();
+  }
   return true;
 }
+
 void runloop::deinit() {
-  console::log(console::priority::notice, "Quitting run loop.\n");
-  all_tasks = nullptr;
+  auto measured = measure_jitter();
+  console::log(
+      console::channel::runloop, console::priority::notice,
+      "Quitting run loop. Frame pacing error since last measured: "_literal,
+      measured.mean * 1000.0, " ms mean, "_literal, measured.max * 1000.0,
+      " ms max over "_literal, measured.frames, " frames.\n"_literal);
+  for (auto &&tasks : phases) {
+    tasks = phase_tasks{};
+  }
+  slots.clear();
+  free_slots.clear();
+  staged_tasks.clear();
+  removals.clear();
+  frame_events.clear();
+
+  // Awaited jobs still point into their coroutines' frames
+  while (jobs_awaited.load(std::memory_order_acquire) > 0) {
+    if (!jobs::run_one()) {
+      std::this_thread::yield();
+    }
+  }
+  while (coroutines != nullptr) {
+    auto next = coroutines->next;
+    coroutine::handle_t::from_promise(*coroutines).destroy();
+    coroutines = next;
+  }
+  coroutines_running = 0;
+  resume_next_tick.clear();
+  jobs_done.clear();
+  timer_nodes.clear();
+  free_timers.clear();
+  timers_pending = 0;
 }
@@ -99,8 +99,8 @@ void celerygame::vulkan::deinit() {
                     vkDestroyImageView(*vulkan::device::logical::get(),
                                        image_view, nullptr);
                   });
-    console::log(console::priority::debug, name,
-                 ": will delete vectors now.\n");
+    console::log<console::priority::debug>(
+        console::channel::vulkan, name, ": will delete vectors now.\n"_literal);
     physical_devices_ptr = nullptr;
     image_views_ptr = nullptr;
     images_ptr = nullptr;
@@ -16,48 +16,153 @@
 #include "../include/celerygame_vulkan_instance.hpp"
 #include "../include/celerygame_cfg.hpp"
 #include "../include/celerygame_console.hpp"
+#include "../include/celerygame_runloop.hpp"
 #include "../include/celerygame_vulkan_utils.hpp"
 using namespace celerygame;
 
 static auto debug_messenger_ptr =
     std::unique_ptr<VkDebugUtilsMessengerEXT>{nullptr};
 
+// Validation layers can repeat one message thousands of times a frame, so
+// every (message ID, severity) pair gets a token bucket and whatever it
+// suppresses is summarized periodically instead.
+
+/// Messages per second one message ID may log once its burst is spent
+static constexpr auto message_rate = F64{2.0};
+/// Messages one message ID may log back to back
+static constexpr auto message_burst = F64{8.0};
+/// How often suppressed repeats of a message ID get summarized
+static constexpr auto summary_period = std::chrono::seconds{1};
+/// Recently seen message IDs we keep track of, a power of two
+static constexpr auto message_slots = std::size_t{256};
+/// How far to probe for a message ID before evicting one
+static constexpr auto message_probes = std::size_t{8};
+
+/// What we remember about a recently seen message ID
+struct message_history {
+  S32 id;
+  U32 severity = 0; ///< 0 if this slot is unused
+  F64 tokens;
+  std::chrono::steady_clock::time_point refilled;
+  std::chrono::steady_clock::time_point summarized;
+  U32 suppressed;
+  char name[64];
+};
+
+static auto message_mutex = std::mutex{};
+static auto message_histories = std::array<message_history, message_slots>{};
+/// Summarizes bursts that stopped, while the debug messenger exists
+static auto summary_timer = runloop::timer{};
+
+/// Map a Vulkan message severity onto a console priority
+static console::priority severity_priority(U32 severity) {
+  if ((severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT) != 0) {
+    return console::priority::error;
+  } else if ((severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT) !=
+             0) {
+    return console::priority::warning;
+  } else if ((severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT) != 0) {
+    return console::priority::informational;
+  }
+  return console::priority::debug;
+}
+
+/// Log how many repeats of a message ID got suppressed, if any
+static void summarize(message_history &history,
+                      std::chrono::steady_clock::time_point now) {
+  if (history.suppressed > 0) {
+    console::log(console::channel::vulkan, severity_priority(history.severity),
+                 "Vulkan: suppressed "_literal, history.suppressed,
+                 " repeats of '"_literal, history.name, "'\n"_literal);
+    history.suppressed = 0;
+  }
+  history.summarized = now;
+}
+
+/// Summarize repeats that have waited a period, even if their message ID
+/// stopped showing up, called by `summary_timer`
+static void summarize_stale(void *) {
+  auto now = std::chrono::steady_clock::now();
+  auto lock = std::lock_guard<std::mutex>{message_mutex};
+  for (auto &&history : message_histories) {
+    if (history.severity != 0 && history.suppressed > 0 &&
+        now - history.summarized >= summary_period) {
+      summarize(history, now);
+    }
+  }
+}
+
+/// Find or make room for a message ID's history
+static message_history &remember(S32 id, U32 severity, const char *name,
+                                 std::chrono::steady_clock::time_point now) {
+  auto hash = (static_cast<U32>(id) * U32{2654435761}) ^ severity;
+  auto oldest = &message_histories[hash & (message_slots - 1)];
+  for (auto i = std::size_t{0}; i < message_probes; i++) {
+    auto &history = message_histories[(hash + i) & (message_slots - 1)];
+    if (history.severity == severity && history.id == id) {
+      return history;
+    }
+    if (history.severity == 0) {
+      oldest = &history;
+      break;
+    }
+    if (history.refilled < oldest->refilled) {
+      oldest = &history;
+    }
+  }
+  if (oldest->severity != 0) {
+    summarize(*oldest, now);
+  }
+  oldest->id = id;
+  oldest->severity = severity;
+  oldest->tokens = message_burst;
+  oldest->refilled = now;
+  oldest->summarized = now;
+  oldest->suppressed = 0;
+  std::snprintf(oldest->name, sizeof(oldest->name), "%s",
+                name == nullptr ? "(unnamed)" : name);
+  return *oldest;
+}
+
 /// The debug messenger callback for logging Vulkan information to stdout.
 static VKAPI_ATTR VkBool32 VKAPI_CALL
 debug_callback(VkDebugUtilsMessageSeverityFlagBitsEXT severity,
                VkDebugUtilsMessageTypeFlagsEXT type,
                const VkDebugUtilsMessengerCallbackDataEXT *callback_data,
                void *user_data) {
-  auto message_type = std::string{};
+  // Verbose messages arrive by the thousand, don't track ones nobody takes
+  if (!console::wants(console::channel::vulkan, severity_priority(severity))) {
+    return VK_FALSE;
+  }
+  char message_type[] = "   ";
   if ((type & VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT) != 0) {
-    message_type += 'G';
-  } else {
-    message_type += ' ';
+    message_type[0] = 'G';
   }
   if ((type & VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT) != 0) {
-    message_type += 'V';
-  } else {
-    message_type += ' ';
+    message_type[1] = 'V';
   }
   if ((type & VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT) != 0) {
-    message_type += 'P';
+    message_type[2] = 'P';
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  auto lock = std::lock_guard<std::mutex>{message_mutex};
+  auto &history = remember(callback_data->messageIdNumber, severity,
+                           callback_data->pMessageIdName, now);
+  auto elapsed = std::chrono::duration<F64>{now - history.refilled}.count();
+  history.tokens =
+      std::min(message_burst, history.tokens + elapsed * message_rate);
+  history.refilled = now;
+  if (history.tokens >= 1.0) {
+    history.tokens -= 1.0;
+    console::log(console::channel::vulkan, severity_priority(severity),
+                 "Vulkan ["_literal, message_type, "]: "_literal,
+                 callback_data->pMessage, "\n"_literal);
   } else {
-    message_type += ' ';
+    history.suppressed++;
   }
-  if ((severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT) != 0) {
-    console::log(console::priority::error, "Vulkan [", message_type,
-                 "]: ", callback_data->pMessage, "\n");
-  } else if ((severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT) !=
-             0) {
-    console::log(console::priority::warning, "Vulkan [", message_type,
-                 "]: ", callback_data->pMessage, "\n");
-  } else if ((severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT) != 0) {
-    console::log(console::priority::informational, "Vulkan [", message_type,
-                 "]: ", callback_data->pMessage, "\n");
-  } else if ((severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT) !=
-             0) {
-    console::log(console::priority::debug, "Vulkan [", message_type,
-                 "]: ", callback_data->pMessage, "\n");
+  if (now - history.summarized >= summary_period) {
+    summarize(history, now);
   }
   return VK_FALSE;
 }
@@ -95,12 +200,14 @@ void vulkan::instance::init(
 
       if (!SDL_Vulkan_GetInstanceExtensions(vulkan::window::get(),
                                             &extensions_count, nullptr)) {
-        console::log(console::priority::alert, SDL_GetError(), "\n");
+        console::log(console::channel::vulkan, console::priority::alert,
+                     SDL_GetError(), "\n"_literal);
       }
       extensions.resize(extensions_count);
       if (!SDL_Vulkan_GetInstanceExtensions(
               vulkan::window::get(), &extensions_count, extensions.data())) {
-        console::log(console::priority::alert, SDL_GetError(), "\n");
+        console::log(console::channel::vulkan, console::priority::alert,
+                     SDL_GetError(), "\n"_literal);
       }
 
       for (auto &&extension_req : extensions_requested) {
@@ -109,8 +216,9 @@ void vulkan::instance::init(
       for (auto &&layer_req : layers_requested) {
         layers.emplace_back(layer_req);
       }
-      console::log(console::priority::debug, name,
-                   ": Debug facilities: ", debug, "\n");
+      console::log<console::priority::debug>(console::channel::vulkan, name,
+                                             ": Debug facilities: "_literal,
+                                             debug, "\n"_literal);
       if (debug) {
         extensions.emplace_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
         layers.emplace_back("VK_LAYER_KHRONOS_validation");
@@ -149,10 +257,15 @@ void vulkan::instance::init(
           vkCreateDebugUtilsMessengerEXT(*vulkan::instance::get(),
                                          &debug_create_info, nullptr,
                                          debug_messenger_ptr.get());
+          summary_timer = runloop::start_timer(
+              std::chrono::duration<F64>{summary_period}.count(),
+              std::chrono::duration<F64>{summary_period}.count(),
+              &summarize_stale, nullptr);
         } else {
-          console::log(
-              console::priority::warning, name,
-              ": Not going to create more than one Vulkan debug messenger.\n");
+          console::log(console::channel::vulkan, console::priority::warning,
+                       name,
+                       ": Not going to create more than one Vulkan debug "
+                       "messenger.\n"_literal);
         }
       } else {
         auto instance_ptr = new VkInstance;
@@ -161,8 +274,8 @@ void vulkan::instance::init(
         vulkan::instance::set(instance_ptr);
       }
     } else {
-      console::log(console::priority::warning, name,
-                   ": singleton already exists.\n");
+      console::log(console::channel::vulkan, console::priority::warning, name,
+                   ": singleton already exists.\n"_literal);
     }
   });
 }
@@ -176,15 +289,27 @@ void vulkan::instance::deinit() {
       vkDestroyDebugUtilsMessengerEXT(*vulkan::instance::get(),
                                       *debug_messenger_ptr, nullptr);
       debug_messenger_ptr = nullptr;
-      console::log(console::priority::debug, name,
-                   ": freed the debug messenger\n");
+      runloop::cancel_timer(summary_timer);
+      console::log<console::priority::debug>(
+          console::channel::vulkan, name,
+          ": freed the debug messenger\n"_literal);
+
+      // No more messages can arrive, so whatever's left gets summarized now
+      auto now = std::chrono::steady_clock::now();
+      auto lock = std::lock_guard<std::mutex>{message_mutex};
+      for (auto &&history : message_histories) {
+        if (history.severity != 0) {
+          summarize(history, now);
+          history.severity = 0;
+        }
+      }
     }
     if (vulkan::instance::get() != nullptr) {
       vkDestroyInstance(*vulkan::instance::get(), nullptr);
       vulkan::instance::set(nullptr);
     } else {
-      console::log(console::priority::warning, name,
-                   ": can't doublefree a singleton.\n");
+      console::log(console::channel::vulkan, console::priority::warning, name,
+                   ": can't doublefree a singleton.\n"_literal);
     }
   });
 }
@@ -28,8 +28,8 @@ void vulkan::window::init(std::string &&window_name, VkExtent2D extents,
           extents.width, extents.height,
           SDL_WINDOW_VULKAN | (fullscreen ? SDL_WINDOW_FULLSCREEN : 0)));
     } else {
-      console::log(console::priority::warning, name,
-                   ": singleton already exists.\n");
+      console::log(console::channel::vulkan, console::priority::warning, name,
+                   ": singleton already exists.\n"_literal);
     }
   });
 }
@@ -40,8 +40,8 @@ void vulkan::window::deinit() {
       SDL_DestroyWindow(vulkan::window::get());
       vulkan::window::set(nullptr);
     } else {
-      console::log(console::priority::warning, name,
-                   ": can't doublefree a singleton.\n");
+      console::log(console::channel::vulkan, console::priority::warning, name,
+                   ": can't doublefree a singleton.\n"_literal);
     }
   });
 }